@@ -16,6 +16,75 @@
 
 using namespace llvm;
 
+/// EvalScope - Values of the variables while an expression is evaluated at
+/// compile time.
+using EvalScope = std::map<std::string, double>;
+
+struct MemoTable;
+
+/// EvalBudget - How much work compile-time evaluation may still do.
+struct EvalBudget {
+    unsigned Fuel;
+    unsigned Depth;
+};
+
+/// ParamType - How a prototype passes an argument or its result. Ints are
+/// 64-bit and only exist at the boundary, inside the function they are
+/// doubles. Buffers and handles are passed on as they are, without copying.
+enum class ParamType {
+    Double, Int, DoublePtr, IntPtr, Handle
+};
+
+static const char *const ParamTypeNames[] = {"double", "int", "double*", "int*", "handle"};
+
+/// getParamTypeName - The spelling of T in a prototype.
+const char *getParamTypeName(ParamType T) {
+    return ParamTypeNames[(int) T];
+}
+
+/// getParamTypeByName - Sets T to the type spelled Name, false if there is none.
+bool getParamTypeByName(const std::string &Name, ParamType &T) {
+    for (unsigned i = 0; i < sizeof(ParamTypeNames) / sizeof(ParamTypeNames[0]); i++)
+        if (Name == ParamTypeNames[i]) {
+            T = (ParamType) i;
+            return true;
+        }
+    return false;
+}
+
+/// RecordLayout - How an array of records is stored: one record after the
+/// other (AoS), or one column per field (SoA).
+enum class RecordLayout {
+    AoS, SoA
+};
+
+/// StructDecl - A record type, named double fields and the layout of arrays
+/// of it. Code using the records does not depend on the layout.
+struct StructDecl {
+    std::string Name;
+    std::vector<std::string> Fields;
+    RecordLayout Layout;
+
+    /// getFieldIndex - The position of Field, -1 if there is no such field.
+    int getFieldIndex(const std::string &Field) const {
+        auto I = std::find(Fields.begin(), Fields.end(), Field);
+        return I == Fields.end() ? -1 : I - Fields.begin();
+    }
+};
+
+/// Structs - Every struct declared so far, by name.
+std::map<std::string, StructDecl> Structs;
+
+/// LoopHints - What the annotations of a loop pin down, 0 leaves it to the
+/// optimizer's heuristics.
+struct LoopHints {
+    unsigned Unroll = 0;     // @unroll(N), 1 keeps the loop rolled.
+    unsigned Vectorize = 0;  // @vectorize(N), the vector width, 1 keeps it scalar.
+    unsigned Interleave = 0; // @interleave(N), copies of the vector body.
+    unsigned Tile = 0;       // @tile(N), iterations per block.
+};
+
+class ForExprAST;
 
 //----------------------------------------------------------------------
 // Expression class node
@@ -23,10 +92,52 @@ using namespace llvm;
 
 /// ExprAST - Virutal base class for all expression nodes.
 class ExprAST {
+    SourceLocation Loc;
+
 public:
+    ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
+
     virtual ~ExprAST() = default;
 
+    int getLine() const { return Loc.Line; }
+
+    int getCol() const { return Loc.Col; }
+
     virtual Value *codegen() = 0;
+
+    /// markTail - Called on an expression whose value is returned straight out
+    /// of the enclosing function, nothing happens after it.
+    virtual void markTail() {}
+
+    /// simplify - Simplify the children in place. Returns a node that replaces
+    /// this one, or null to keep it.
+    virtual std::unique_ptr<ExprAST> simplify() { return nullptr; }
+
+    /// evaluate - Compute the value at compile time. Returns false if the
+    /// expression has side effects or the budget runs out.
+    virtual bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) { return false; }
+
+    /// getConstant - Returns true and sets V if this is a literal.
+    virtual bool getConstant(double &V) const { return false; }
+
+    /// getVariableName - The name of the variable this expression reads, or
+    /// null if it is not a plain variable.
+    virtual const std::string *getVariableName() const { return nullptr; }
+
+    /// getForLoop - This expression if it is a for loop, or null.
+    virtual ForExprAST *getForLoop() { return nullptr; }
+
+    /// codegenAssign - Store Val where this expression reads from, the left
+    /// side of '='. Returns Val.
+    virtual Value *codegenAssign(Value *Val);
+
+    /// codegenCond - Emit the expression as an i1 condition, true when the
+    /// value is ordered and not 0.0.
+    virtual Value *codegenCond();
+
+    /// codegenBranch - Emit the expression as a condition and branch on it.
+    /// Conditions made of && || ! branch directly, without building an i1.
+    virtual bool codegenBranch(BasicBlock *TrueBB, BasicBlock *FalseBB);
 };
 
 
@@ -37,6 +148,24 @@ public:
     NumberExprAST(double DoubleVal) : DoubleVal(DoubleVal) {}
 
     Value *codegen() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
+
+    bool getConstant(double &V) const override {
+        V = DoubleVal;
+        return true;
+    }
+};
+
+/// StringExprAST - Expression class for string literals like "cache". A string
+/// is a handle to its characters, for functions that take a name.
+class StringExprAST : public ExprAST {
+    std::string Val;
+
+public:
+    StringExprAST(const std::string &Val) : Val(Val) {}
+
+    Value *codegen() override;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
@@ -44,25 +173,129 @@ class VariableExprAST : public ExprAST {
     std::string Name;
 
 public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
+    VariableExprAST(const std::string &Name, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Name(Name) {}
 
     const std::string &getName() const { return Name; }
 
+    const std::string *getVariableName() const override { return &Name; }
+
+    Value *codegen() override;
+
+    Value *codegenAssign(Value *Val) override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
+};
+
+/// IndexExprAST - Expression class for an element of a host buffer, "p[i]".
+/// Elements of an int* buffer read and write as doubles.
+class IndexExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Base, Index;
+
+    /// codegenAddress - Emit the address of the element.
+    Value *codegenAddress();
+
+public:
+    IndexExprAST(std::unique_ptr<ExprAST> Base, std::unique_ptr<ExprAST> Index,
+                 SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Base(std::move(Base)), Index(std::move(Index)) {}
+
     Value *codegen() override;
+
+    Value *codegenAssign(Value *Val) override;
+
+    std::unique_ptr<ExprAST> simplify() override;
 };
 
+/// RecordArrayExprAST - Expression class for defining an array of Count
+/// records, "var ps: Particle[n]". Its storage is allocated for the function,
+/// or the doubles of a host buffer, "var ps: Particle[n] = buf", laid out the
+/// way the struct says. It keeps the struct as it was declared when the
+/// definition was parsed, a later redeclaration doesn't change its code.
+class RecordArrayExprAST : public ExprAST {
+    std::string Name;
+    StructDecl Decl;
+    std::unique_ptr<ExprAST> Count, Storage;
+
+public:
+    RecordArrayExprAST(const std::string &Name, const StructDecl &Decl, std::unique_ptr<ExprAST> Count,
+                       std::unique_ptr<ExprAST> Storage, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Name(Name), Decl(Decl), Count(std::move(Count)),
+              Storage(std::move(Storage)) {}
+
+    Value *codegen() override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+};
+
+/// FieldExprAST - Expression class for a field of a record in an array,
+/// "ps[i].x".
+class FieldExprAST : public ExprAST {
+    std::string Array, Field;
+    std::unique_ptr<ExprAST> Index;
+
+    /// codegenAddress - Emit the address of the field.
+    Value *codegenAddress();
+
+public:
+    FieldExprAST(const std::string &Array, std::unique_ptr<ExprAST> Index, const std::string &Field,
+                 SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Array(Array), Field(Field), Index(std::move(Index)) {}
+
+    Value *codegen() override;
+
+    Value *codegenAssign(Value *Val) override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+};
+
+
+/// UnaryExprAST - Expression class for a unary operator, only '!' for now.
+class UnaryExprAST : public ExprAST {
+    int Op;
+    std::unique_ptr<ExprAST> Operand;
 
-/// BinaryExprAST - Expression class for a binary operator.
+public:
+    UnaryExprAST(int Op, std::unique_ptr<ExprAST> Operand, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Op(Op), Operand(std::move(Operand)) {}
+
+    Value *codegen() override;
+
+    Value *codegenCond() override;
+
+    bool codegenBranch(BasicBlock *TrueBB, BasicBlock *FalseBB) override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
+};
+
+/// BinaryExprAST - Expression class for a binary operator. Op is the character
+/// or, for two-character operators, the token.
 class BinaryExprAST : public ExprAST {
-    char Op;
+    int Op;
     std::unique_ptr<ExprAST> LHS, RHS;
 
+    bool isComparison() const {
+        return Op == '<' || Op == '>' || Op == tok_eq || Op == tok_ne || Op == tok_le || Op == tok_ge;
+    }
+
+    bool isLogical() const { return Op == tok_and || Op == tok_or; }
+
 public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                  std::unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    BinaryExprAST(int Op, std::unique_ptr<ExprAST> LHS,
+                  std::unique_ptr<ExprAST> RHS, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
 
     Value *codegen() override;
+
+    Value *codegenCond() override;
+
+    bool codegenBranch(BasicBlock *TrueBB, BasicBlock *FalseBB) override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
 };
 
 /// VarDefineExprAST - Expression class for defining a new variable.
@@ -73,47 +306,116 @@ public:
             Varnames(std::move(Varnames)) {}
 
     Value *codegen() override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
     std::string Callee;
     std::vector<std::unique_ptr<ExprAST>> Args;
+    bool IsTail = false;
 public:
     CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args)
-            : Callee(Callee), Args(std::move(Args)) {}
+                std::vector<std::unique_ptr<ExprAST>> Args, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Callee(Callee), Args(std::move(Args)) {}
 
     Value *codegen() override;
+
+    /// codegenVectorBuiltin - Emit a call to one of the VectorBuiltins.
+    Value *codegenVectorBuiltin();
+
+    /// getConstantArgs - The literal arguments passed to double parameters.
+    ConstArgs getConstantArgs() const;
+
+    void markTail() override { IsTail = true; }
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
+/// of arguments the function takes) and their types.
 class PrototypeAST {
     std::string Name;
     std::vector<std::string> Args;
+    std::vector<ParamType> ArgTypes;
+    ParamType RetType;
+    int Line;
 
 public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-            : Name(Name), Args(std::move(Args)) {}
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args, SourceLocation Loc = CurLoc,
+                 std::vector<ParamType> ArgTypes = {}, ParamType RetType = ParamType::Double)
+            : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)), RetType(RetType),
+              Line(Loc.Line) {
+        this->ArgTypes.resize(this->Args.size(), ParamType::Double);
+    }
 
     Function *codegen();
 
     const std::string &getName() const { return Name; }
+
+    int getLine() const { return Line; }
+
+    const std::vector<std::string> &getArgs() const { return Args; }
+
+    ParamType getArgType(unsigned i) const { return ArgTypes[i]; }
+
+    ParamType getRetType() const { return RetType; }
+
+    /// withName - A copy of the prototype for a function called NewName.
+    std::unique_ptr<PrototypeAST> withName(const std::string &NewName) const {
+        auto Copy = llvm::make_unique<PrototypeAST>(*this);
+        Copy->Name = NewName;
+        return Copy;
+    }
+
+    /// isAllDouble - True for the plain signature, doubles in and out.
+    bool isAllDouble() const {
+        return RetType == ParamType::Double &&
+               std::all_of(ArgTypes.begin(), ArgTypes.end(),
+                           [](ParamType T) { return T == ParamType::Double; });
+    }
 };
 
 /// FunctionAST - This class represents a function definition itself.
 class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
     std::vector<std::unique_ptr<ExprAST>> Body;
+    bool Memo, Fast;
+    // Set while a specialized copy is generated.
+    const ConstArgs *Bound = nullptr;
+    std::string SpecName;
+    // The memo table of the first codegen, a tier-up keeps using it.
+    MemoTable *Table = nullptr;
 
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::vector<std::unique_ptr<ExprAST>> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
+                std::vector<std::unique_ptr<ExprAST>> Body, bool Memo = false,
+                bool Fast = false)
+            : Proto(std::move(Proto)), Body(std::move(Body)), Memo(Memo), Fast(Fast) {}
 
-    Function *codegen();
+    /// codegen - Generate and optimize the function, at MinTier or the tier
+    /// the cost model picks if that is higher.
+    Function *codegen(OptTier MinTier = TierQuick);
+
+    /// codegenSpecialization - Generate a copy of the function called Name
+    /// with the arguments in Bound replaced by their constants. It takes the
+    /// same arguments as the original.
+    Function *codegenSpecialization(const std::string &Name, const ConstArgs &Bound);
+
+    bool isMemo() const { return Memo; }
+
+    /// simplify - Fold what is constant. Calls to other definitions only fold
+    /// with FoldCalls, for code that runs once: compiled code keeps a folded
+    /// result when the callee is redefined.
+    void simplify(bool FoldCalls = false);
+
+    std::vector<std::unique_ptr<ExprAST>> &getBody() { return Body; }
 };
 
 ///// ReturnAST - This class return a expression or null.
@@ -142,6 +444,18 @@ public:
             : Cond(std::move(Cond)), Then(std::move(Then)) {}
 
     Value *codegen() override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
+
+    /// Only an if with an else yields the value of its branches.
+    void markTail() override {
+        if (Then.empty() || Else.empty() || !Then.back() || !Else.back())
+            return;
+        Then.back()->markTail();
+        Else.back()->markTail();
+    }
 };
 
 /// ForExprAST - Expression class for for/in
@@ -149,18 +463,70 @@ class ForExprAST : public ExprAST {
     std::string VarName;
     std::unique_ptr<ExprAST> Start, End, Step;
     std::vector<std::unique_ptr<ExprAST>> Body;
+    LoopHints Hints;
+
+    Value *codegenTiled();
 
 public:
     ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
                std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-               std::vector<std::unique_ptr<ExprAST>> Body)
+               std::vector<std::unique_ptr<ExprAST>> Body, LoopHints Hints = LoopHints())
             : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-              Step(std::move(Step)), Body(std::move(Body)) {}
+              Step(std::move(Step)), Body(std::move(Body)), Hints(Hints) {}
+
+    ForExprAST *getForLoop() override { return this; }
+
+    Value *codegen() override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
+};
+
+/// WhileExprAST - Expression class for while loops.
+class WhileExprAST : public ExprAST {
+    std::unique_ptr<ExprAST> Cond;
+    std::vector<std::unique_ptr<ExprAST>> Body;
+
+public:
+    WhileExprAST(std::unique_ptr<ExprAST> Cond, std::vector<std::unique_ptr<ExprAST>> Body)
+            : Cond(std::move(Cond)), Body(std::move(Body)) {}
 
     Value *codegen() override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
 };
 
-/// BodyExpr - Expression for a set of expression around by braces.
+/// RegionExprAST - Expression class for a region block, "region { ... }".
+/// What the body allocates is released when the block ends, and so are the
+/// pointers and arrays of records it defines.
+class RegionExprAST : public ExprAST {
+    std::vector<std::unique_ptr<ExprAST>> Body;
+
+public:
+    RegionExprAST(std::vector<std::unique_ptr<ExprAST>> Body) : Body(std::move(Body)) {}
+
+    Value *codegen() override;
+
+    std::unique_ptr<ExprAST> simplify() override;
+};
+
+/// BreakExprAST - Leave the innermost loop.
+class BreakExprAST : public ExprAST {
+public:
+    Value *codegen() override;
+};
+
+/// ContinueExprAST - Go on with the next iteration of the innermost loop.
+class ContinueExprAST : public ExprAST {
+public:
+    Value *codegen() override;
+};
+
+/// BodyExpr - Expression for a set of expression around by braces, its value
+/// is the value of the last one.
 class BodyExprAST : public ExprAST {
     std::vector<std::unique_ptr<ExprAST>> Body;
 public:
@@ -168,11 +534,25 @@ public:
             : Body(std::move(Body)) {}
 
     Value *codegen() override;
+
+    void markTail() override {
+        if (!Body.empty() && Body.back())
+            Body.back()->markTail();
+    }
+
+    std::unique_ptr<ExprAST> simplify() override;
+
+    bool evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) override;
 };
 
+/// NumErrors - How many errors were reported so far.
+unsigned NumErrors = 0;
+
 /// LogError* - These are little helper functions for error handling.
 std::unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
+    NumErrors++;
+    OutPrintf("Error: %s\n", Str);
+    FlushOutput();
     return nullptr;
 }
 
@@ -7,32 +7,173 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils.h"
+#include "RuntimeIO.cpp"
+#include "Tiering.cpp"
+#include "Specialize.cpp"
 #include "AST.cpp"
+#include "Remarks.cpp"
+#include "Runtime.cpp"
+#include <cmath>
+#include <functional>
 #include <string>
 
 LLVMContext TheContext;
 IRBuilder<> Builder(TheContext);
 std::unique_ptr<Module> TheModule;
-std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+/// TheFPMs - The function pass pipeline of each tier for TheModule.
+std::unique_ptr<legacy::FunctionPassManager> TheFPMs[NumOptTiers];
+/// ModuleTier - The highest tier of a function in TheModule, which sets the
+/// backend optimization level of the whole module.
+OptTier ModuleTier;
 std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
 std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+/// BuiltinProtos - The functions the host and the prelude provide, the
+/// prototypes every import starts from.
+std::map<std::string, std::unique_ptr<PrototypeAST>> BuiltinProtos;
+
+/// AddBuiltinProto - Make a function the host provides callable, from the
+/// importer and from every import.
+void AddBuiltinProto(std::unique_ptr<PrototypeAST> Proto) {
+    BuiltinProtos[Proto->getName()] = llvm::make_unique<PrototypeAST>(*Proto);
+    FunctionProtos[Proto->getName()] = std::move(Proto);
+}
 /// map the defined variable to Value*.
 std::map<std::string, Value *> NamedValues;
 
+/// RecordArray - An array of records of the function being compiled: the
+/// slots that hold its storage and its length.
+struct RecordArray {
+    const StructDecl *Decl;
+    AllocaInst *Base, *Count;
+};
+
+/// RecordArrays - The arrays of records defined so far in the function.
+std::map<std::string, RecordArray> RecordArrays;
+
+/// FunctionAllocates - The function allocates from the thread's region, so
+/// it releases what it allocated when it returns.
+bool FunctionAllocates;
+
+/// RegionMarks - The marks of the region blocks around the code being
+/// generated, innermost last.
+std::vector<Value *> RegionMarks;
+
+/// RegionScopes - The variables as each region block around the code being
+/// generated found them, innermost last.
+std::vector<std::map<std::string, Value *>> RegionScopes;
+
+/// ReportTailCalls - Tell the user about recursive calls that are still calls
+/// after tail recursion elimination ran.
+static cl::opt<bool> ReportTailCalls("report-tail-calls",
+                                     cl::desc("Report recursive calls that could not be turned into loops"),
+                                     cl::init(false));
+
+/// MemoCapacity - Number of results a memo function keeps.
+static cl::opt<unsigned> MemoCapacity("memo-capacity",
+                                      cl::desc("Entries in the result cache of each memo function"),
+                                      cl::init(4096));
+
+/// CheckMemoCapacity - Reject a -memo-capacity no table can have.
+void CheckMemoCapacity() {
+    if (MemoCapacity > MaxMemoCapacity) {
+        LogError(("-memo-capacity can be at most " + std::to_string(MaxMemoCapacity)).c_str());
+        MemoCapacity = MaxMemoCapacity;
+    }
+}
+
+/// FastMath - Treat every function as if it was declared 'fast def'.
+static cl::opt<bool> FastMath("fast-math",
+                              cl::desc("Allow all fast-math optimizations in every function"),
+                              cl::init(false));
+
+enum FPOpt { FPContract, FPReassoc, FPNoNaNs, FPNoInfs, FPNoSignedZeros, FPReciprocal };
+
+/// FPOpts - The individual fast-math relaxations, e.g. -fp=contract,reassoc.
+static cl::list<FPOpt> FPOpts("fp", cl::CommaSeparated,
+                              cl::desc("Floating-point relaxations to allow in every function"),
+                              cl::values(clEnumValN(FPContract, "contract", "Fuse multiply and add"),
+                                         clEnumValN(FPReassoc, "reassoc", "Reassociate arithmetic"),
+                                         clEnumValN(FPNoNaNs, "no-nans", "Assume no NaNs"),
+                                         clEnumValN(FPNoInfs, "no-infs", "Assume no infinities"),
+                                         clEnumValN(FPNoSignedZeros, "no-signed-zeros",
+                                                    "Ignore the sign of zero"),
+                                         clEnumValN(FPReciprocal, "reciprocal",
+                                                    "Allow x/y to become x*(1/y)")));
+
+/// EmitDebugInfo - Describe the generated code in DWARF, so debuggers and
+/// profilers can map it back to L source lines.
+static cl::opt<bool> EmitDebugInfo("g", cl::desc("Emit DWARF line info for JIT'd code"),
+                                   cl::init(false));
+
+/// DBuilder - Builds the debug info of TheModule, null without -g or -remarks.
+std::unique_ptr<DIBuilder> DBuilder;
+DICompileUnit *TheCU;
+DISubprogram *CurrentSubprogram;
+
+/// InitializeDebugInfo - Start the debug info of a new TheModule. Remarks
+/// need it too, for their line numbers.
+void InitializeDebugInfo() {
+    if (!EmitDebugInfo && RemarksPath.empty())
+        return;
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    TheModule->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+    DBuilder = llvm::make_unique<DIBuilder>(*TheModule);
+    TheCU = DBuilder->createCompileUnit(dwarf::DW_LANG_C, DBuilder->createFile(InputName, "."),
+                                        "L Compiler", /*isOptimized=*/true, "", 0);
+}
+
+/// FinalizeDebugInfo - Finish the debug info before TheModule is handed off.
+void FinalizeDebugInfo() {
+    if (DBuilder)
+        DBuilder->finalize();
+}
+
+/// EmitLocation - Give the instructions built from here on the location of
+/// AST, or no location if it is null.
+void EmitLocation(ExprAST *AST) {
+    if (!DBuilder)
+        return;
+    if (!AST || !CurrentSubprogram) {
+        Builder.SetCurrentDebugLocation(DebugLoc());
+        return;
+    }
+    Builder.SetCurrentDebugLocation(DILocation::get(TheContext, AST->getLine(), AST->getCol(), CurrentSubprogram));
+}
+
+/// CreateSubprogram - Describe F, defined at Line, and make it the scope of the
+/// locations that follow.
+void CreateSubprogram(Function *F, unsigned Line) {
+    if (!DBuilder)
+        return;
+    DIFile *Unit = TheCU->getFile();
+    DIType *DblTy = DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+    SmallVector<Metadata *, 8> Types(F->arg_size() + 1, DblTy);
+    DISubroutineType *FnTy = DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(Types));
+    CurrentSubprogram = DBuilder->createFunction(Unit, F->getName(), StringRef(), Unit, Line, FnTy, Line,
+                                                 DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    F->setSubprogram(CurrentSubprogram);
+    EmitLocation(nullptr); // The prologue has no location.
+}
+
 Function *getFunction(std::string Name) {
     // First, see if the function has already been added to the current module.
     if (auto *F = TheModule->getFunction(Name))
@@ -48,12 +189,56 @@ Function *getFunction(std::string Name) {
     return nullptr;
 }
 
+/// getSignature - The type of F as text. Versions of a function share a slot
+/// only if they have the same type.
+std::string getSignature(const Function &F) {
+    std::string Signature;
+    raw_string_ostream OS(Signature);
+    F.getFunctionType()->print(OS);
+    return OS.str();
+}
+
+/// MathBuiltin - A math function that is lowered to an LLVM intrinsic, so the
+/// optimizer can fold, hoist and vectorize it like any other instruction.
+struct MathBuiltin {
+    const char *Name;
+    unsigned NumArgs;
+    Intrinsic::ID ID;
+    double (*Eval)(const double *Args); // Used to fold calls on constants.
+};
+
+static const MathBuiltin MathBuiltins[] = {
+        {"sqrt",  1, Intrinsic::sqrt,   [](const double *A) { return std::sqrt(A[0]); }},
+        {"sin",   1, Intrinsic::sin,    [](const double *A) { return std::sin(A[0]); }},
+        {"cos",   1, Intrinsic::cos,    [](const double *A) { return std::cos(A[0]); }},
+        {"exp",   1, Intrinsic::exp,    [](const double *A) { return std::exp(A[0]); }},
+        {"log",   1, Intrinsic::log,    [](const double *A) { return std::log(A[0]); }},
+        {"pow",   2, Intrinsic::pow,    [](const double *A) { return std::pow(A[0], A[1]); }},
+        {"fabs",  1, Intrinsic::fabs,   [](const double *A) { return std::fabs(A[0]); }},
+        {"floor", 1, Intrinsic::floor,  [](const double *A) { return std::floor(A[0]); }},
+        {"fma",   3, Intrinsic::fma,    [](const double *A) { return std::fma(A[0], A[1], A[2]); }},
+        {"min",   2, Intrinsic::minnum, [](const double *A) { return std::fmin(A[0], A[1]); }},
+        {"max",   2, Intrinsic::maxnum, [](const double *A) { return std::fmax(A[0], A[1]); }},
+};
+
+/// getMathBuiltin - Find the builtin called Name. A 'def' of the same name
+/// hides the builtin.
+const MathBuiltin *getMathBuiltin(const std::string &Name) {
+    if (FunctionProtos.count(Name))
+        return nullptr;
+    for (const MathBuiltin &B : MathBuiltins)
+        if (Name == B.Name)
+            return &B;
+    return nullptr;
+}
+
 /// CreateEntryBlockAlloca - Binding VarName with a new space, and insert into the begining of the block.
+/// Variables are doubles unless Ty says otherwise.
 AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                   const std::string &VarName) {
+                                   const std::string &VarName, Type *Ty = nullptr) {
     IRBuilder<> Tmp(&TheFunction->getEntryBlock(),
                     TheFunction->getEntryBlock().begin());
-    return Tmp.CreateAlloca(Type::getDoubleTy(TheContext), nullptr, VarName);
+    return Tmp.CreateAlloca(Ty ? Ty : Type::getDoubleTy(TheContext), nullptr, VarName);
 }
 
 Value *LogErrorV(const char *Str) {
@@ -61,6 +246,189 @@ Value *LogErrorV(const char *Str) {
     return nullptr;
 }
 
+/// ReportRecursiveCalls - Print every call F still makes to itself.
+void ReportRecursiveCalls(Function &F) {
+    for (auto &BB : F)
+        for (auto &I : BB)
+            if (auto *CI = dyn_cast<CallInst>(&I))
+                if (CI->getCalledFunction() == &F)
+                    OutPrintf("Note: recursive call in '%s' is %s, it was not turned into a loop\n",
+                              F.getName().str().c_str(),
+                              CI->isTailCall() ? "a tail call" : "not in tail position");
+}
+
+
+//----------------------------------------------------------------------
+// Vector values
+//----------------------------------------------------------------------
+
+/// getVectorWidth - Number of lanes of a vector value, 0 for a scalar.
+unsigned getVectorWidth(Value *V) {
+    if (auto *VT = dyn_cast<VectorType>(V->getType()))
+        return VT->getNumElements();
+    return 0;
+}
+
+/// MatchWidths - Splat the scalars among Values to the width of the vectors.
+/// Fails if there are vectors of different widths.
+bool MatchWidths(std::vector<Value *> &Values) {
+    unsigned Width = 0;
+    for (Value *V : Values) {
+        if (V->getType()->isPointerTy()) {
+            LogError("buffers and handles can only be indexed, assigned or passed on");
+            return false;
+        }
+        unsigned W = getVectorWidth(V);
+        if (W && Width && W != Width) {
+            LogError("vectors of different widths");
+            return false;
+        }
+        Width = std::max(Width, W);
+    }
+    if (Width)
+        for (Value *&V : Values)
+            if (!getVectorWidth(V))
+                V = Builder.CreateVectorSplat(Width, V, "splat");
+    return true;
+}
+
+bool MatchWidths(Value *&L, Value *&R) {
+    std::vector<Value *> Values = {L, R};
+    if (!MatchWidths(Values))
+        return false;
+    L = Values[0];
+    R = Values[1];
+    return true;
+}
+
+/// CreateBoolToDouble - Turn an i1 condition into 0.0 or 1.0, lane by lane for
+/// a vector of conditions.
+Value *CreateBoolToDouble(Value *C) {
+    Type *Ty = Type::getDoubleTy(TheContext);
+    if (unsigned W = getVectorWidth(C))
+        Ty = VectorType::get(Ty, W);
+    return Builder.CreateUIToFP(C, Ty, "booltmp");
+}
+
+/// EmitReduction - Combine the lanes of V pairwise with Combine, in log2(N)
+/// steps of halving the vector, and return the result as a double.
+Value *EmitReduction(Value *V, const std::function<Value *(Value *, Value *)> &Combine) {
+    for (unsigned N = getVectorWidth(V); N > 1; N /= 2) {
+        SmallVector<uint32_t, 8> Lo, Hi;
+        for (unsigned i = 0; i < N / 2; i++) {
+            Lo.push_back(i);
+            Hi.push_back(i + N / 2);
+        }
+        Value *Undef = UndefValue::get(V->getType());
+        Value *A = Builder.CreateShuffleVector(V, Undef, ConstantDataVector::get(TheContext, Lo), "lo");
+        Value *B = Builder.CreateShuffleVector(V, Undef, ConstantDataVector::get(TheContext, Hi), "hi");
+        V = Combine(A, B);
+    }
+    return Builder.CreateExtractElement(V, Builder.getInt32(0), "reduced");
+}
+
+/// VectorBuiltins - Functions on vectors that need no extern:
+///   vec2/vec4/vec8(x...)  a vector of N doubles, or of one double splatted
+///   lane(v, i)            lane i of v
+///   shuffle(a, b, i...)   a vector of the lanes of a then b at constant indices
+///   hsum/hmin/hmax(v)     sum, minimum or maximum of the lanes
+///   select(m, a, b)       lanes of a where m is true, of b where it is not
+static const char *const VectorBuiltins[] = {
+        "vec2", "vec4", "vec8", "lane", "shuffle", "hsum", "hmin", "hmax", "select",
+};
+
+/// isVectorBuiltin - True if calls to Name are vector builtins, unless the
+/// user defined a function of that name.
+bool isVectorBuiltin(const std::string &Name) {
+    if (FunctionProtos.count(Name))
+        return false;
+    for (const char *B : VectorBuiltins)
+        if (Name == B)
+            return true;
+    return false;
+}
+
+Value *CallExprAST::codegenVectorBuiltin() {
+    if (Callee == "shuffle") {
+        if (Args.size() < 3)
+            return LogErrorV("shuffle takes two vectors and the lanes to pick");
+        Value *A = Args[0]->codegen();
+        Value *B = A ? Args[1]->codegen() : nullptr;
+        if (!B)
+            return nullptr;
+        unsigned W = getVectorWidth(A);
+        if (!W || W != getVectorWidth(B))
+            return LogErrorV("shuffle takes two vectors of the same width");
+        if (Args.size() - 2 != 2 && Args.size() - 2 != 4 && Args.size() - 2 != 8)
+            return LogErrorV("shuffle makes a vector of 2, 4 or 8 lanes");
+
+        SmallVector<uint32_t, 8> Mask;
+        for (unsigned i = 2; i < Args.size(); i++) {
+            double Idx;
+            if (!Args[i]->getConstant(Idx) || Idx < 0 || Idx >= 2 * W || Idx != (uint32_t) Idx)
+                return LogErrorV("shuffle lanes must be constants below twice the width");
+            Mask.push_back((uint32_t) Idx);
+        }
+        EmitLocation(this);
+        return Builder.CreateShuffleVector(A, B, ConstantDataVector::get(TheContext, Mask), "shuffle");
+    }
+
+    if (Callee == "select") {
+        if (Args.size() != 3)
+            return LogErrorV("select takes a mask and two values");
+        std::vector<Value *> Ops = {Args[0]->codegenCond()};
+        if (!Ops[0] || !(Ops.push_back(Args[1]->codegen()), Ops[1]) ||
+            !(Ops.push_back(Args[2]->codegen()), Ops[2]) || !MatchWidths(Ops))
+            return nullptr;
+        EmitLocation(this);
+        return Builder.CreateSelect(Ops[0], Ops[1], Ops[2], "select");
+    }
+
+    std::vector<Value *> ArgsV;
+    for (auto &Arg : Args) {
+        ArgsV.push_back(Arg->codegen());
+        if (!ArgsV.back())
+            return nullptr;
+    }
+    EmitLocation(this);
+
+    if (Callee == "lane") {
+        if (ArgsV.size() != 2 || !getVectorWidth(ArgsV[0]) || getVectorWidth(ArgsV[1]))
+            return LogErrorV("lane takes a vector and a lane number");
+        double Idx;
+        if (Args[1]->getConstant(Idx) && (Idx < 0 || Idx >= getVectorWidth(ArgsV[0])))
+            return LogErrorV("lane number out of range");
+        Value *I = Builder.CreateFPToUI(ArgsV[1], Builder.getInt32Ty(), "laneidx");
+        return Builder.CreateExtractElement(ArgsV[0], I, "lane");
+    }
+
+    if (Callee[0] == 'h') { // hsum, hmin, hmax
+        if (ArgsV.size() != 1)
+            return LogErrorV("reductions take one vector");
+        // A double is its own reduction.
+        if (!getVectorWidth(ArgsV[0]))
+            return ArgsV[0];
+        if (Callee == "hsum")
+            return EmitReduction(ArgsV[0], [](Value *A, Value *B) { return Builder.CreateFAdd(A, B, "hsum"); });
+        if (Callee == "hmin")
+            return EmitReduction(ArgsV[0], [](Value *A, Value *B) { return Builder.CreateMinNum(A, B, "hmin"); });
+        return EmitReduction(ArgsV[0], [](Value *A, Value *B) { return Builder.CreateMaxNum(A, B, "hmax"); });
+    }
+
+    // vec2, vec4, vec8
+    unsigned W = Callee[3] - '0';
+    for (Value *V : ArgsV)
+        if (getVectorWidth(V))
+            return LogErrorV("vector lanes must be doubles");
+    if (ArgsV.size() == 1)
+        return Builder.CreateVectorSplat(W, ArgsV[0], "splat");
+    if (ArgsV.size() != W)
+        return LogErrorV("a vector takes one double or one per lane");
+    Value *V = UndefValue::get(VectorType::get(Type::getDoubleTy(TheContext), W));
+    for (unsigned i = 0; i < W; i++)
+        V = Builder.CreateInsertElement(V, ArgsV[i], Builder.getInt32(i), "vec");
+    return V;
+}
 
 Value *NumberExprAST::codegen() {
     return ConstantFP::get(TheContext, APFloat(DoubleVal)); ///@todo Add more type here.
@@ -71,30 +439,293 @@ Value *VariableExprAST::codegen() {
     Value *V = NamedValues[Name];
     if (!V)
         return LogErrorV("Unknown variable name");
+    // Loop variables are plain SSA values, everything else lives in an alloca.
+    if (!isa<AllocaInst>(V))
+        return V;
+    EmitLocation(this);
     return Builder.CreateLoad(V, Name.c_str()); // return ref of variable.
 }
 
+Value *ExprAST::codegenAssign(Value *Val) {
+    return LogErrorV("left side of '=' must be a variable or a buffer element");
+}
+
+Value *VariableExprAST::codegenAssign(Value *Val) {
+    Value *Variable = NamedValues[Name];
+    if (!Variable)
+        return LogErrorV("Unknown variable name");
+    if (!isa<AllocaInst>(Variable))
+        return LogErrorV("cannot assign to a loop variable");
+    if (Val->getType() != cast<AllocaInst>(Variable)->getAllocatedType())
+        return LogErrorV("cannot assign a value of a different type to this variable");
+    // A variable from outside the innermost region block outlives what the
+    // block allocates.
+    if (Val->getType()->isPointerTy() && !RegionScopes.empty()) {
+        auto &Outer = RegionScopes.back();
+        auto OI = Outer.find(Name);
+        if (OI != Outer.end() && OI->second == Variable)
+            return LogErrorV("memory allocated in a region block can't leave it");
+    }
+    EmitLocation(this);
+    Builder.CreateStore(Val, Variable);
+    return Val;
+}
+
+Value *IndexExprAST::codegenAddress() {
+    Value *Ptr = Base->codegen();
+    if (!Ptr)
+        return nullptr;
+    auto *PtrTy = dyn_cast<PointerType>(Ptr->getType());
+    if (!PtrTy || PtrTy->getElementType()->isIntegerTy(8))
+        return LogErrorV("only double* and int* buffers can be indexed");
+    Value *I = Index->codegen();
+    if (!I)
+        return nullptr;
+    if (!I->getType()->isDoubleTy())
+        return LogErrorV("an index must be a number");
+    EmitLocation(this);
+    I = Builder.CreateFPToSI(I, Type::getInt64Ty(TheContext), "idx");
+    return Builder.CreateInBoundsGEP(PtrTy->getElementType(), Ptr, I, "elem");
+}
+
+Value *IndexExprAST::codegen() {
+    Value *Addr = codegenAddress();
+    if (!Addr)
+        return nullptr;
+    Value *Elem = Builder.CreateLoad(Addr, "load");
+    if (Elem->getType()->isIntegerTy())
+        return Builder.CreateSIToFP(Elem, Type::getDoubleTy(TheContext), "fromint");
+    return Elem;
+}
+
+Value *IndexExprAST::codegenAssign(Value *Val) {
+    if (!Val->getType()->isDoubleTy())
+        return LogErrorV("buffer elements are numbers");
+    Value *Addr = codegenAddress();
+    if (!Addr)
+        return nullptr;
+    Value *Elem = Val;
+    if (cast<PointerType>(Addr->getType())->getElementType()->isIntegerTy())
+        Elem = Builder.CreateFPToSI(Val, Type::getInt64Ty(TheContext), "toint");
+    Builder.CreateStore(Elem, Addr);
+    return Val;
+}
+
+//----------------------------------------------------------------------
+// Arrays of records
+//----------------------------------------------------------------------
+
+/// getRuntimeFunction - Declare the C function Name in TheModule.
+FunctionCallee getRuntimeFunction(const char *Name, Type *RetTy, ArrayRef<Type *> Params) {
+    return TheModule->getOrInsertFunction(Name, FunctionType::get(RetTy, Params, false));
+}
+
+/// CreateEntryBlockSlot - An alloca in the entry block of the current
+/// function that holds Init until it is first stored to.
+AllocaInst *CreateEntryBlockSlot(const std::string &Name, Constant *Init) {
+    BasicBlock &Entry = Builder.GetInsertBlock()->getParent()->getEntryBlock();
+    IRBuilder<> Tmp(&Entry, Entry.begin());
+    AllocaInst *Slot = Tmp.CreateAlloca(Init->getType(), nullptr, Name);
+    Tmp.CreateStore(Init, Slot);
+    return Slot;
+}
+
+/// EmitRegionMark - Mark the thread's region with B, see Region.cpp.
+Value *EmitRegionMark(IRBuilder<> &B) {
+    Type *Int8PtrTy = Type::getInt8PtrTy(TheContext);
+    return B.CreateCall(getRuntimeFunction("regionmark", Int8PtrTy, {}), {}, "regionmark");
+}
+
+/// EmitRegionRewind - Release what was allocated since Mark.
+void EmitRegionRewind(Value *Mark) {
+    Type *Int8PtrTy = Type::getInt8PtrTy(TheContext);
+    Builder.CreateCall(getRuntimeFunction("regionrewind", Type::getVoidTy(TheContext), {Int8PtrTy}), {Mark});
+}
+
+/// EmitAlloc - N zeroed doubles from the thread's region.
+Value *EmitAlloc(Value *N) {
+    Type *Int64Ty = Type::getInt64Ty(TheContext);
+    FunctionAllocates = true;
+    return Builder.CreateCall(getRuntimeFunction("alloc", Type::getDoublePtrTy(TheContext), {Int64Ty}), {N},
+                              "alloc");
+}
+
+/// Safepoints - Let code running under a time limit be stopped, see
+/// Preempt.cpp.
+static cl::opt<bool> Safepoints("safepoints",
+                                cl::desc("Poll for preemption at loop back edges and function entries"),
+                                cl::init(false));
+
+/// MaxUnpolledTrips - A loop with constant bounds and at most this many
+/// iterations has no poll, so it can still be vectorized. The loops and
+/// calls in its body poll on their own.
+static const double MaxUnpolledTrips = 65536;
+
+/// EmitSafepoint - Poll for preemption: load the flag the watchdog raises and
+/// call safepoint() in the rare case it is up. Code goes on in a new block.
+void EmitSafepoint() {
+    if (!Safepoints)
+        return;
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Type *Int32Ty = Type::getInt32Ty(TheContext);
+    LoadInst *Flag = Builder.CreateLoad(TheModule->getOrInsertGlobal("safepointflag", Int32Ty), "safepointflag");
+    Flag->setVolatile(true);
+
+    BasicBlock *PollBB = BasicBlock::Create(TheContext, "safepoint", TheFunction);
+    BasicBlock *ContBB = BasicBlock::Create(TheContext, "safepoint.cont", TheFunction);
+    Builder.CreateCondBr(Builder.CreateICmpNE(Flag, Builder.getInt32(0)), PollBB, ContBB,
+                         MDBuilder(TheContext).createBranchWeights(1, 1 << 20));
+    Builder.SetInsertPoint(PollBB);
+    Builder.CreateCall(getRuntimeFunction("safepoint", Type::getVoidTy(TheContext), {}), {});
+    Builder.CreateBr(ContBB);
+    Builder.SetInsertPoint(ContBB);
+}
+
+Value *RecordArrayExprAST::codegen() {
+    Value *N = Count->codegen();
+    if (!N)
+        return nullptr;
+    if (!N->getType()->isDoubleTy())
+        return LogErrorV("the length of an array of records must be a number");
+    Value *S = nullptr;
+    if (Storage) {
+        S = Storage->codegen();
+        if (!S)
+            return nullptr;
+        if (S->getType() != Type::getDoublePtrTy(TheContext))
+            return LogErrorV("an array of records can only be laid over a double* buffer");
+    }
+    EmitLocation(this);
+
+    Type *Int64Ty = Type::getInt64Ty(TheContext);
+    PointerType *DoublePtrTy = Type::getDoublePtrTy(TheContext);
+    RecordArray &A = RecordArrays[Name];
+    A.Decl = &Decl;
+    A.Count = CreateEntryBlockSlot(Name + ".count", ConstantInt::get(Int64Ty, 0));
+    A.Base = CreateEntryBlockSlot(Name + ".base", ConstantPointerNull::get(DoublePtrTy));
+    Value *Len = Builder.CreateFPToSI(N, Int64Ty, "len");
+    Builder.CreateStore(Len, A.Count);
+
+    // Zeroed storage of its own, from the region.
+    if (!S)
+        S = EmitAlloc(Builder.CreateMul(Len, ConstantInt::get(Int64Ty, Decl.Fields.size()), "elems"));
+    Builder.CreateStore(S, A.Base);
+    return N;
+}
+
+Value *FieldExprAST::codegenAddress() {
+    auto AI = RecordArrays.find(Array);
+    if (AI == RecordArrays.end())
+        return LogErrorV(("Unknown array of records " + Array).c_str());
+    const RecordArray &A = AI->second;
+    int F = A.Decl->getFieldIndex(Field);
+    if (F < 0)
+        return LogErrorV(("struct " + A.Decl->Name + " has no field " + Field).c_str());
+    Value *I = Index->codegen();
+    if (!I)
+        return nullptr;
+    if (!I->getType()->isDoubleTy())
+        return LogErrorV("an index must be a number");
+    EmitLocation(this);
+
+    // AoS: record i starts at i * #fields. SoA: column F starts at F * length.
+    Type *Int64Ty = Type::getInt64Ty(TheContext);
+    I = Builder.CreateFPToSI(I, Int64Ty, "idx");
+    Value *Offset;
+    if (A.Decl->Layout == RecordLayout::AoS)
+        Offset = Builder.CreateAdd(Builder.CreateMul(I, ConstantInt::get(Int64Ty, A.Decl->Fields.size())),
+                                   ConstantInt::get(Int64Ty, F), "offset");
+    else
+        Offset = Builder.CreateAdd(Builder.CreateMul(Builder.CreateLoad(A.Count, "len"), ConstantInt::get(Int64Ty, F)),
+                                   I, "offset");
+    Value *Base = Builder.CreateLoad(A.Base, Array.c_str());
+    return Builder.CreateInBoundsGEP(Type::getDoubleTy(TheContext), Base, Offset, Field.c_str());
+}
+
+Value *FieldExprAST::codegen() {
+    Value *Addr = codegenAddress();
+    if (!Addr)
+        return nullptr;
+    return Builder.CreateLoad(Addr, "field");
+}
+
+Value *FieldExprAST::codegenAssign(Value *Val) {
+    if (!Val->getType()->isDoubleTy())
+        return LogErrorV("fields of records are numbers");
+    Value *Addr = codegenAddress();
+    if (!Addr)
+        return nullptr;
+    Builder.CreateStore(Val, Addr);
+    return Val;
+}
+
+//----------------------------------------------------------------------
+// Regions
+//----------------------------------------------------------------------
+
+Value *StringExprAST::codegen() {
+    return Builder.CreateGlobalStringPtr(Val, "str");
+}
+
+Value *RegionExprAST::codegen() {
+    EmitLocation(this);
+    Value *Mark = EmitRegionMark(Builder);
+    RegionMarks.push_back(Mark);
+    RegionScopes.push_back(NamedValues);
+    auto OuterArrays = RecordArrays;
+    Value *Last = Constant::getNullValue(Type::getDoubleTy(TheContext));
+    for (auto &E : Body) {
+        Last = E ? E->codegen() : nullptr;
+        if (!Last)
+            break;
+    }
+    RegionMarks.pop_back();
+
+    // The pointers the block defined point into memory that is released now,
+    // the names are the outer variables again after it.
+    std::map<std::string, Value *> Outer = std::move(RegionScopes.back());
+    RegionScopes.pop_back();
+    for (auto &V : NamedValues) {
+        auto *Alloca = dyn_cast_or_null<AllocaInst>(V.second);
+        if (!Alloca || !Alloca->getAllocatedType()->isPointerTy())
+            continue;
+        auto OI = Outer.find(V.first);
+        if (OI == Outer.end())
+            V.second = nullptr;
+        else if (OI->second != Alloca)
+            V.second = OI->second;
+    }
+    RecordArrays = std::move(OuterArrays);
+    if (!Last)
+        return nullptr;
+    if (Last->getType()->isPointerTy())
+        return LogErrorV("memory allocated in a region block can't leave it");
+    EmitRegionRewind(Mark);
+    return Last;
+}
+
 Value *BinaryExprAST::codegen() {
     if (Op == '=') {
-        VariableExprAST *LHSE = static_cast<VariableExprAST *> (LHS.get());
-        if (!LHSE)
-            return LogErrorV("right side of '=' must be a variable");
         Value *Val = RHS->codegen();
-        if (!Val) {
+        if (!Val)
             return nullptr;
-        }
-        Value *Variable = NamedValues[LHSE->getName()];
-        if (!Variable)
-            return LogErrorV("Unknown variable name");
-        Builder.CreateStore(Val, Variable);
-        return Val;
+        return LHS->codegenAssign(Val);
     }
+    if (isComparison() || isLogical()) {
+        Value *C = codegenCond();
+        if (!C)
+            return nullptr;
+        // Convert bool 0/1 to double 0.0 or 1.0, only where a value is needed.
+        return CreateBoolToDouble(C);
+    }
+
     Value *L = LHS->codegen(); // ExprAST 的codegen 可以是父类的codegen，可以产生任何类型的codegen
     Value *R = RHS->codegen();
 
-    if (!L || !R)
+    if (!L || !R || !MatchWidths(L, R))
         return nullptr;
 
+    EmitLocation(this);
     switch (Op) {
         case '+':
             return Builder.CreateFAdd(L, R, "Faddtmp");
@@ -104,27 +735,183 @@ Value *BinaryExprAST::codegen() {
             return Builder.CreateFMul(L, R, "Fmultmp");
         case '/':
             return Builder.CreateFDiv(L, R, "Fdivtmp");
+        default:
+            return LogErrorV("invalid binary operator");
+    }
+}
+
+Value *ExprAST::codegenCond() {
+    Value *V = codegen();
+    if (!V)
+        return nullptr;
+    if (V->getType()->isPointerTy())
+        return LogErrorV("a buffer or handle can't be a condition");
+    // Convert condition to a bool by comparing non-equal to 0.0, lane by lane
+    // for a vector.
+    return Builder.CreateFCmpONE(V, Constant::getNullValue(V->getType()), "cond");
+}
+
+bool ExprAST::codegenBranch(BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    Value *C = codegenCond();
+    if (!C)
+        return false;
+    if (getVectorWidth(C)) {
+        LogError("a vector can't be a condition, use select");
+        return false;
+    }
+    Builder.CreateCondBr(C, TrueBB, FalseBB);
+    return true;
+}
+
+/// CreateBoolPHI - Merge a branch on a condition back into an i1 value.
+Value *CreateBoolPHI(ExprAST &E) {
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    BasicBlock *TrueBB = BasicBlock::Create(TheContext, "cond.true", TheFunction);
+    BasicBlock *FalseBB = BasicBlock::Create(TheContext, "cond.false", TheFunction);
+    BasicBlock *MergeBB = BasicBlock::Create(TheContext, "cond.end", TheFunction);
+    if (!E.codegenBranch(TrueBB, FalseBB))
+        return nullptr;
+
+    Builder.SetInsertPoint(TrueBB);
+    Builder.CreateBr(MergeBB);
+    Builder.SetInsertPoint(FalseBB);
+    Builder.CreateBr(MergeBB);
+
+    Builder.SetInsertPoint(MergeBB);
+    PHINode *PN = Builder.CreatePHI(Type::getInt1Ty(TheContext), 2, "condtmp");
+    PN->addIncoming(Builder.getTrue(), TrueBB);
+    PN->addIncoming(Builder.getFalse(), FalseBB);
+    return PN;
+}
+
+Value *BinaryExprAST::codegenCond() {
+    if (isLogical())
+        return CreateBoolPHI(*this);
+    if (!isComparison())
+        return ExprAST::codegenCond();
+
+    Value *L = LHS->codegen();
+    Value *R = RHS->codegen();
+    if (!L || !R || !MatchWidths(L, R))
+        return nullptr;
+
+    EmitLocation(this);
+    switch (Op) {
         case '<':
-            L = Builder.CreateFCmpULT(L, R, "Fcmpless");
-            // Convert bool 0/1 to double 0.0 or 1.0
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
+            return Builder.CreateFCmpULT(L, R, "Fcmpless");
         case '>':
-            L = Builder.CreateFCmpUGT(L, R, "FcmpGreater");
-            // Convert bool 0/1 to double 0.0 or 1.0
-            return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), "booltmp");
+            return Builder.CreateFCmpUGT(L, R, "FcmpGreater");
+        case tok_le:
+            return Builder.CreateFCmpULE(L, R, "FcmpLessEq");
+        case tok_ge:
+            return Builder.CreateFCmpUGE(L, R, "FcmpGreaterEq");
+        case tok_eq:
+            return Builder.CreateFCmpOEQ(L, R, "FcmpEq");
+        default: // tok_ne
+            return Builder.CreateFCmpUNE(L, R, "FcmpNotEq");
+    }
+}
+
+bool BinaryExprAST::codegenBranch(BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    if (!isLogical())
+        return ExprAST::codegenBranch(TrueBB, FalseBB);
+
+    // Short circuit: the right side is only evaluated when the left side does
+    // not decide the result.
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    BasicBlock *RHSBB = BasicBlock::Create(TheContext, Op == tok_and ? "and.rhs" : "or.rhs", TheFunction);
+    bool Ok = Op == tok_and ? LHS->codegenBranch(RHSBB, FalseBB)
+                            : LHS->codegenBranch(TrueBB, RHSBB);
+    if (!Ok)
+        return false;
+
+    Builder.SetInsertPoint(RHSBB);
+    return RHS->codegenBranch(TrueBB, FalseBB);
+}
+
+Value *UnaryExprAST::codegen() {
+    Value *C = codegenCond();
+    if (!C)
+        return nullptr;
+    EmitLocation(this);
+    return CreateBoolToDouble(C);
+}
+
+Value *UnaryExprAST::codegenCond() {
+    Value *C = Operand->codegenCond();
+    if (!C)
+        return nullptr;
+    EmitLocation(this);
+    return Builder.CreateNot(C, "nottmp");
+}
+
+bool UnaryExprAST::codegenBranch(BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    return Operand->codegenBranch(FalseBB, TrueBB);
+}
+
+/// getParamType - The LLVM type a prototype passes T as.
+Type *getParamType(ParamType T) {
+    switch (T) {
+        case ParamType::Int:
+            return Type::getInt64Ty(TheContext);
+        case ParamType::DoublePtr:
+            return Type::getDoublePtrTy(TheContext);
+        case ParamType::IntPtr:
+            return Type::getInt64PtrTy(TheContext);
+        case ParamType::Handle:
+            return Type::getInt8PtrTy(TheContext);
         default:
-            return LogErrorV("invalid binary operator");
+            return Type::getDoubleTy(TheContext);
+    }
+}
+
+/// CreateArgument - Pass V as a parameter of type Ty. Numbers are truncated
+/// to an int parameter, everything else is passed as it is and must match.
+Value *CreateArgument(Value *V, Type *Ty) {
+    if (Ty->isIntegerTy() && V->getType()->isDoubleTy())
+        return Builder.CreateFPToSI(V, Ty, "toint");
+    if (V->getType() != Ty) {
+        if (getVectorWidth(V))
+            return LogErrorV("functions take doubles, pass the lanes of a vector one by one");
+        return LogErrorV("argument does not match the type of the parameter");
+    }
+    return V;
+}
+
+ConstArgs CallExprAST::getConstantArgs() const {
+    ConstArgs Constants;
+    auto PI = FunctionProtos.find(Callee);
+    if (PI == FunctionProtos.end() || PI->second->getArgs().size() != Args.size())
+        return Constants;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        double V;
+        if (PI->second->getArgType(i) == ParamType::Double && Args[i]->getConstant(V)) {
+            uint64_t Bits;
+            memcpy(&Bits, &V, sizeof(Bits));
+            Constants.push_back({i, Bits});
+        }
     }
+    return Constants;
 }
 
 Value *CallExprAST::codegen() {
-    // Look up the name in the global module table.
-    Function *CalleeF = getFunction(Callee);
-    if (!CalleeF)
+    if (isVectorBuiltin(Callee))
+        return codegenVectorBuiltin();
+
+    // Look up the name in the global module table, unless it is a math builtin.
+    // Calls that pass constants may have a specialized copy to go to, except
+    // from imported code, which is cached and only calls what it can see.
+    const MathBuiltin *B = getMathBuiltin(Callee);
+    std::string Target = Callee;
+    if (!B && !ImportDepth)
+        if (const std::string *Spec = NoteConstantCall(Callee, getConstantArgs()))
+            Target = *Spec;
+    Function *CalleeF = B ? nullptr : getFunction(Target);
+    if (!B && !CalleeF)
         return LogErrorV("Unknown function referenced");
 
     // If argument mismatch error.
-    if (CalleeF->arg_size() != Args.size())
+    if ((B ? B->NumArgs : CalleeF->arg_size()) != Args.size())
         return LogErrorV("Incorrect # arguments passed");
 
     std::vector<Value *> ArgsV;
@@ -134,14 +921,59 @@ Value *CallExprAST::codegen() {
             return nullptr;
     }
 
-    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+    if (B) {
+        // Math builtins become intrinsics rather than calls to the C library,
+        // on vectors they work lane by lane.
+        if (!MatchWidths(ArgsV))
+            return nullptr;
+        CalleeF = Intrinsic::getDeclaration(TheModule.get(), B->ID, {ArgsV[0]->getType()});
+    } else {
+        for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+            if (!(ArgsV[i] = CreateArgument(ArgsV[i], CalleeF->getFunctionType()->getParamType(i))))
+                return nullptr;
+    }
+
+    EmitLocation(this);
+    // A published function is called through its slot, so callers go to a
+    // new version of the same type, tiered up or redefined, on their next
+    // call. Imported code is cached and calls the symbol, and so does a
+    // function calling itself, whose new version is the one being compiled.
+    const orc::KaleidoscopeJIT::FunctionSlot *Slot = nullptr;
+    if (!B && !ImportDepth && CalleeF != Builder.GetInsertBlock()->getParent()) {
+        std::string Signature = getSignature(*CalleeF);
+        Slot = TheJIT->getFunctionSlot(Target, &Signature);
+    }
+    CallInst *CI;
+    if (Slot) {
+        FunctionType *FT = CalleeF->getFunctionType();
+        Value *SlotPtr = ConstantExpr::getIntToPtr(
+                ConstantInt::get(Type::getInt64Ty(TheContext), (uint64_t) (uintptr_t) Slot),
+                FT->getPointerTo()->getPointerTo());
+        LoadInst *Fn = Builder.CreateAlignedLoad(SlotPtr, 8, Target + ".slot");
+        Fn->setAtomic(AtomicOrdering::Acquire);
+        CI = Builder.CreateCall(FT, Fn, ArgsV, "calltmp");
+    } else {
+        CI = Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+    }
+    // L values never point into the caller's frame, so a call in tail position
+    // can always reuse it. Host buffers belong to the host. Builtins are
+    // intrinsics, not calls, and are left for the optimizer to fold.
+    if (IsTail && !B)
+        CI->setTailCall();
+    // A call that returns memory may have allocated it from our region.
+    if (CI->getType()->isPointerTy())
+        FunctionAllocates = true;
+    if (CI->getType()->isIntegerTy())
+        return Builder.CreateSIToFP(CI, Type::getDoubleTy(TheContext), "fromint");
+    return CI;
 }
 
 Function *PrototypeAST::codegen() {
     // Make the function type:  double(double,double) etc.
-    std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
-    FunctionType *FT =
-            FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+    std::vector<Type *> Params;
+    for (ParamType T : ArgTypes)
+        Params.push_back(getParamType(T));
+    FunctionType *FT = FunctionType::get(getParamType(RetType), Params, false);
 
     Function *F =
             Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
@@ -155,23 +987,151 @@ Function *PrototypeAST::codegen() {
 }
 
 Value *BodyExprAST::codegen() {
+    Value *Last = Constant::getNullValue(Type::getDoubleTy(TheContext));
     for (unsigned i = 0; i < Body.size(); i++) {
-        Body[i]->codegen();
+        Last = Body[i]->codegen();
+        if (!Last)
+            return nullptr;
     }
-    return nullptr;
+    return Last;
 }
 
-Function *FunctionAST::codegen() {
+/// GetFastMathFlags - The relaxations a function is compiled with, Fast is
+/// set for a 'fast def'.
+FastMathFlags GetFastMathFlags(bool Fast) {
+    FastMathFlags FMF;
+    if (Fast || FastMath) {
+        FMF.setFast();
+        return FMF;
+    }
+    for (FPOpt Opt : FPOpts) {
+        switch (Opt) {
+            case FPContract:
+                FMF.setAllowContract(true);
+                break;
+            case FPReassoc:
+                FMF.setAllowReassoc();
+                break;
+            case FPNoNaNs:
+                FMF.setNoNaNs();
+                break;
+            case FPNoInfs:
+                FMF.setNoInfs();
+                break;
+            case FPNoSignedZeros:
+                FMF.setNoSignedZeros();
+                break;
+            case FPReciprocal:
+                FMF.setAllowReciprocal();
+                break;
+        }
+    }
+    return FMF;
+}
 
-    auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
+/// SetFastMathAttributes - Tell the backend about the relaxations as well, so
+/// it can make the same assumptions during instruction selection.
+void SetFastMathAttributes(Function *F, FastMathFlags FMF) {
+    if (FMF.isFast())
+        F->addFnAttr("unsafe-fp-math", "true");
+    if (FMF.noNaNs())
+        F->addFnAttr("no-nans-fp-math", "true");
+    if (FMF.noInfs())
+        F->addFnAttr("no-infs-fp-math", "true");
+    if (FMF.noSignedZeros())
+        F->addFnAttr("no-signed-zeros-fp-math", "true");
+    if (FMF.allowContract())
+        F->addFnAttr("less-precise-fpmad", "true");
+}
+
+/// EmitMemoWrapper - Move the body of F into F.impl and make F look the
+/// arguments up in Table first. Recursive calls still go to F, so they hit
+/// the table too. Returns the new F.impl.
+Function *EmitMemoWrapper(Function *F, MemoTable *Table) {
+    Type *DoubleTy = Type::getDoubleTy(TheContext);
+    Type *DoublePtrTy = DoubleTy->getPointerTo();
+    Type *Int8PtrTy = Type::getInt8PtrTy(TheContext);
+    Type *Int32Ty = Type::getInt32Ty(TheContext);
+
+    Function *Impl = Function::Create(F->getFunctionType(), Function::InternalLinkage,
+                                      F->getName() + ".impl", TheModule.get());
+    Impl->copyAttributesFrom(F);
+    Impl->getBasicBlockList().splice(Impl->end(), F->getBasicBlockList());
+    auto ImplArg = Impl->arg_begin();
+    for (auto &Arg : F->args()) {
+        ImplArg->setName(Arg.getName());
+        Arg.replaceAllUsesWith(&*ImplArg++);
+    }
+
+    // The source lines now belong to F.impl, the wrapper has none.
+    Impl->setSubprogram(F->getSubprogram());
+    F->setSubprogram(nullptr);
+    EmitLocation(nullptr);
+
+    Value *TablePtr = ConstantExpr::getIntToPtr(
+            ConstantInt::get(Type::getInt64Ty(TheContext), (uint64_t) (uintptr_t) Table), Int8PtrTy);
+    FunctionCallee Lookup = TheModule->getOrInsertFunction(
+            "memo_lookup", FunctionType::get(Int32Ty, {Int8PtrTy, DoublePtrTy, DoublePtrTy}, false));
+    FunctionCallee Insert = TheModule->getOrInsertFunction(
+            "memo_insert", FunctionType::get(Type::getVoidTy(TheContext),
+                                             {Int8PtrTy, DoublePtrTy, DoubleTy}, false));
+
+    BasicBlock *EntryBB = BasicBlock::Create(TheContext, "entry", F);
+    BasicBlock *HitBB = BasicBlock::Create(TheContext, "memohit", F);
+    BasicBlock *MissBB = BasicBlock::Create(TheContext, "memomiss", F);
+    Builder.SetInsertPoint(EntryBB);
+
+    // The key is the argument tuple laid out as an array of doubles.
+    ArrayType *KeyTy = ArrayType::get(DoubleTy, std::max<size_t>(F->arg_size(), 1));
+    AllocaInst *Key = Builder.CreateAlloca(KeyTy, nullptr, "memokey");
+    AllocaInst *Cached = Builder.CreateAlloca(DoubleTy, nullptr, "memoval");
+    std::vector<Value *> ArgsV;
+    unsigned Idx = 0;
+    for (auto &Arg : F->args()) {
+        Builder.CreateStore(&Arg, Builder.CreateConstInBoundsGEP2_32(KeyTy, Key, 0, Idx++));
+        ArgsV.push_back(&Arg);
+    }
+    Value *KeyPtr = Builder.CreateConstInBoundsGEP2_32(KeyTy, Key, 0, 0);
+
+    Value *Found = Builder.CreateCall(Lookup, {TablePtr, KeyPtr, Cached}, "found");
+    Builder.CreateCondBr(Builder.CreateICmpNE(Found, ConstantInt::get(Int32Ty, 0)), HitBB, MissBB);
+
+    Builder.SetInsertPoint(HitBB);
+    Builder.CreateRet(Builder.CreateLoad(Cached, "cached"));
+
+    Builder.SetInsertPoint(MissBB);
+    Value *Result = Builder.CreateCall(Impl, ArgsV, "result");
+    Builder.CreateCall(Insert, {TablePtr, KeyPtr, Result});
+    Builder.CreateRet(Result);
+
+    return Impl;
+}
+
+Function *FunctionAST::codegen(OptTier MinTier) {
+    // The memo table keys on the arguments as doubles.
+    if (Memo && !Proto->isAllDouble()) {
+        LogError("only functions of doubles can be memo");
+        return nullptr;
+    }
+    // Imported code is cached, but the table is only in this process.
+    if (Memo && ImportDepth) {
+        LogError("memo functions can't be defined in an imported file");
+        return nullptr;
+    }
+
+    // Other modules declare the function from a copy of the prototype, this
+    // one stays with the body so the function can be compiled again. A
+    // specialized copy has a prototype of its own.
+    std::unique_ptr<PrototypeAST> SpecProto = Bound ? Proto->withName(SpecName) : nullptr;
+    auto &P = SpecProto ? *SpecProto : *Proto;
+    FunctionProtos[P.getName()] = llvm::make_unique<PrototypeAST>(P);
 
     // Look up the function, see if the function has been added to the current module.
     Function *TheFunction = getFunction(P.getName());
 
     // If not, see if we can generate code from exist prototype and body.
     if (!TheFunction)
-        TheFunction = Proto->codegen();
+        TheFunction = P.codegen();
 
     // If cannot, return nullptr;
     if (!TheFunction)
@@ -180,38 +1140,126 @@ Function *FunctionAST::codegen() {
     // Create a new basic block to start insertion into.
     BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
     Builder.SetInsertPoint(BB);
+    CreateSubprogram(TheFunction, P.getLine());
+
+    // Every floating-point operation in the body carries the same flags.
+    FastMathFlags FMF = GetFastMathFlags(Fast);
+    Builder.setFastMathFlags(FMF);
+    SetFastMathAttributes(TheFunction, FMF);
 
     // Record the function arguments in the NamedValues map.
 
+    // Int arguments become doubles, buffers and handles keep their type. The
+    // bound arguments of a specialization are constants.
     NamedValues.clear();
+    RecordArrays.clear();
+    RegionMarks.clear();
+    RegionScopes.clear();
+    FunctionAllocates = false;
     for (auto &Arg : TheFunction->args()) {
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
-        Builder.CreateStore(&Arg, Alloca);
+        Value *V = &Arg;
+        double C;
+        if (Bound && getBoundValue(*Bound, Arg.getArgNo(), C))
+            V = ConstantFP::get(TheContext, APFloat(C));
+        else if (Arg.getType()->isIntegerTy())
+            V = Builder.CreateSIToFP(V, Type::getDoubleTy(TheContext), Arg.getName());
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), V->getType());
+        Builder.CreateStore(V, Alloca);
         NamedValues[Arg.getName()] = Alloca;
     }
+    // Recursion that never ends is stopped here.
+    EmitSafepoint();
 
     // generating code
     for (unsigned i = 0; i < Body.size() - 1; i++) {
         Body[i]->codegen();
     }
 
-    if (Value *RetVal = Body.back()->codegen()) {
-
-        // Finish off the function.
+    // The value of the last expression is what the function returns.
+    Body.back()->markTail();
+
+    Value *RetVal = Body.back()->codegen();
+    Type *RetTy = TheFunction->getReturnType();
+    if (RetVal && getVectorWidth(RetVal)) {
+        LogError("functions return a double, reduce the vector with hsum, hmin, hmax or lane");
+        RetVal = nullptr;
+    } else if (RetVal && RetTy->isIntegerTy() && RetVal->getType()->isDoubleTy()) {
+        RetVal = Builder.CreateFPToSI(RetVal, RetTy, "toint");
+    } else if (RetVal && RetVal->getType() != RetTy) {
+        LogError("the value of the function does not match its return type");
+        RetVal = nullptr;
+    }
+    if (RetVal) {
+
+        // Finish off the function. Unless it returns a pointer, what it
+        // allocated is released.
+        if (FunctionAllocates && !RetTy->isPointerTy()) {
+            BasicBlock &Entry = TheFunction->getEntryBlock();
+            IRBuilder<> Tmp(&Entry, Entry.begin());
+            Value *Mark = EmitRegionMark(Tmp);
+            EmitRegionRewind(Mark);
+        }
         Builder.CreateRet(RetVal);
 
+        // A tail call to another function of the same type that is returned
+        // directly can be forced into a jump. Calls to ourselves are left to
+        // tail recursion elimination, which turns them into a loop.
+        // Calls through a slot have no called function.
+        if (auto *CI = dyn_cast<CallInst>(RetVal)) {
+            Function *Callee = CI->getCalledFunction();
+            if (CI->isTailCall() && CI->getParent() == Builder.GetInsertBlock() &&
+                CI->getNextNode() == Builder.GetInsertBlock()->getTerminator() &&
+                Callee != TheFunction && !(Callee && Callee->isIntrinsic()) &&
+                CI->getFunctionType() == TheFunction->getFunctionType())
+                CI->setTailCallKind(CallInst::TCK_MustTail);
+        }
+
         // Validate the generated code, checking for consistency.
         verifyFunction(*TheFunction);
-        //TheFPM->run(*TheFunction);
+
+        // Pick the pipeline from the unoptimized code and how often an
+        // earlier definition of the function was called.
+        FunctionProfile &Profile = GetProfile(P.getName());
+        OptTier Tier = std::max(MinTier, ChooseTier(MeasureFunction(*TheFunction), Profile.Calls));
+        Profile.Tier = Tier;
+        ModuleTier = std::max(ModuleTier, Tier);
+        CompileTimer Timer;
+
+        if (Memo) {
+            // Only a new definition starts over, recompiling this one at a
+            // higher tier keeps what it has cached.
+            if (!Table)
+                Table = GetMemoTable(P.getName(), TheFunction->arg_size(), MemoCapacity);
+            Function *Impl = EmitMemoWrapper(TheFunction, Table);
+            verifyFunction(*Impl);
+            verifyFunction(*TheFunction);
+            TheFPMs[Tier]->run(*Impl);
+        }
+        TheFPMs[Tier]->run(*TheFunction);
+
+        if (ReportTailCalls)
+            ReportRecursiveCalls(*TheFunction);
+        CurrentSubprogram = nullptr;
         return TheFunction;
     }
 
     // Error reading body, remove function.
     TheFunction->eraseFromParent();
+    CurrentSubprogram = nullptr;
     return nullptr;
 }
 
+Function *FunctionAST::codegenSpecialization(const std::string &Name, const ConstArgs &Bound) {
+    this->Bound = &Bound;
+    SpecName = Name;
+    Function *F = codegen(TierFull);
+    this->Bound = nullptr;
+    SpecName.clear();
+    return F;
+}
+
 Value *VarDefineExprAST::codegen() {
+    EmitLocation(this);
     Function *TheFunction = Builder.GetInsertBlock()->getParent();
     Value *InitVal;
 
@@ -226,7 +1274,7 @@ Value *VarDefineExprAST::codegen() {
                 return nullptr;
         } else
             InitVal = ConstantFP::get(TheContext, APFloat(0.0));
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Varname);
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Varname, InitVal->getType());
         Builder.CreateStore(InitVal, Alloca);
         NamedValues[Varname] = Alloca;
     }
@@ -234,32 +1282,29 @@ Value *VarDefineExprAST::codegen() {
 }
 
 Value *IfElseAST::codegen() {
+    EmitLocation(this);
     bool has_else = false; // false means no else
     if (!Else.empty()) has_else = true;
-    Value *CondV = Cond->codegen();
-    if (!CondV)
-        return nullptr;
-
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    CondV = Builder.CreateFCmpONE(
-            CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
 
     Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
-    // Create blocks for the then and else cases.  Insert the 'then' block at the
-    // end of the function.
-    BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
+    // Create blocks for the then and else cases, and branch on the condition
+    // directly.
+    BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then");
     BasicBlock *ResidualBB, *ElseBB, *MergeBB;
     if (has_else) {
         ElseBB = BasicBlock::Create(TheContext, "else");
         MergeBB = BasicBlock::Create(TheContext, "ifcont");
-        Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+        if (!Cond->codegenBranch(ThenBB, ElseBB))
+            return nullptr;
     } else {
-        ResidualBB = BasicBlock::Create(TheContext, "residual", TheFunction);
-        Builder.CreateCondBr(CondV, ThenBB, ResidualBB);
+        ResidualBB = BasicBlock::Create(TheContext, "residual");
+        if (!Cond->codegenBranch(ThenBB, ResidualBB))
+            return nullptr;
     }
 
-    // Emit then value.
+    // Emit then value at the end of the function.
+    TheFunction->getBasicBlockList().push_back(ThenBB);
     Builder.SetInsertPoint(ThenBB);
 
     Value *ThenV = Then[0]->codegen();
@@ -271,6 +1316,7 @@ Value *IfElseAST::codegen() {
         return nullptr;
     if (!has_else) {
         Builder.CreateBr(ResidualBB);
+        TheFunction->getBasicBlockList().push_back(ResidualBB);
         Builder.SetInsertPoint(ResidualBB);
         return Constant::getNullValue(Type::getDoubleTy(TheContext));
     }
@@ -295,89 +1341,433 @@ Value *IfElseAST::codegen() {
     // Emit merge block.
     TheFunction->getBasicBlockList().push_back(MergeBB);
     Builder.SetInsertPoint(MergeBB);
-    PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+    if (ThenV->getType() != ElseV->getType())
+        return LogErrorV("both branches of an if must be doubles or vectors of the same width");
+    PHINode *PN = Builder.CreatePHI(ThenV->getType(), 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
     return PN;
 }
 
+/// LoopTarget - Where break and continue jump to in one enclosing loop.
+struct LoopTarget {
+    BasicBlock *Continue;
+    BasicBlock *Break;
+    size_t RegionDepth; // Region blocks open outside the loop.
+};
+
+/// LoopTargets - The loops around the code being generated, innermost last.
+std::vector<LoopTarget> LoopTargets;
+
+/// isSmallInteger - An integral double that converts to i64 and back exactly.
+static bool isSmallInteger(double V) {
+    return std::floor(V) == V && std::fabs(V) < 9007199254740992.0;
+}
+
+/// EmitLoopBody - Emit the body of a loop with break/continue pointing at
+/// LatchBB and ExitBB, then fall through to LatchBB.
+bool EmitLoopBody(std::vector<std::unique_ptr<ExprAST>> &Body, BasicBlock *LatchBB,
+                  BasicBlock *ExitBB) {
+    LoopTargets.push_back({LatchBB, ExitBB, RegionMarks.size()});
+    for (auto &E : Body) {
+        if (!E || !E->codegen()) {
+            LoopTargets.pop_back();
+            return false;
+        }
+    }
+    LoopTargets.pop_back();
+    Builder.CreateBr(LatchBB);
+    return true;
+}
+
+/// getLoopID - The llvm.loop metadata for what Hints pin down, null if they
+/// leave everything to the heuristics.
+static MDNode *getLoopID(const LoopHints &Hints) {
+    SmallVector<Metadata *, 4> Ops;
+    Ops.push_back(nullptr); // Replaced by the node itself.
+    auto AddHint = [&](const char *Name, unsigned N) {
+        Ops.push_back(MDNode::get(TheContext, {MDString::get(TheContext, Name),
+                                               ConstantAsMetadata::get(Builder.getInt32(N))}));
+    };
+    if (Hints.Unroll == 1)
+        Ops.push_back(MDNode::get(TheContext, MDString::get(TheContext, "llvm.loop.unroll.disable")));
+    else if (Hints.Unroll)
+        AddHint("llvm.loop.unroll.count", Hints.Unroll);
+    if (Hints.Vectorize) {
+        // An explicit width also lets the vectorizer reorder reductions.
+        AddHint("llvm.loop.vectorize.width", Hints.Vectorize);
+        if (Hints.Vectorize > 1)
+            Ops.push_back(MDNode::get(TheContext, {MDString::get(TheContext, "llvm.loop.vectorize.enable"),
+                                                   ConstantAsMetadata::get(Builder.getTrue())}));
+    }
+    if (Hints.Interleave)
+        AddHint("llvm.loop.interleave.count", Hints.Interleave);
+    if (Ops.size() == 1)
+        return nullptr;
+    MDNode *LoopID = MDNode::getDistinct(TheContext, Ops);
+    LoopID->replaceOperandWith(0, LoopID);
+    return LoopID;
+}
+
+/// Loops are emitted already rotated, in the shape the loop passes expect:
+///
+///   guard:    br cond, preheader, after
+///   preheader: br body
+///   body:     ... br latch
+///   latch:    br cond, body, exit        ; continue jumps here
+///   exit:     br after                   ; break jumps here
+///   after:
+///
+/// The condition is evaluated once in the guard and then once per iteration in
+/// the latch, the same number of times as a test at the top of the loop.
 Value *ForExprAST::codegen() {
+    EmitLocation(this);
+    if (Hints.Tile > 1)
+        return codegenTiled();
+
     // Emit the start code first, without 'variable' in scope.
     Value *StartVal = Start->codegen();
     if (!StartVal)
         return nullptr;
 
     Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Type *DoubleTy = Type::getDoubleTy(TheContext);
+    Type *Int64Ty = Type::getInt64Ty(TheContext);
 
-    BasicBlock *EntryBB = Builder.GetInsertBlock(); // Get entry block
-
-    // InitBB - The block that initializing loop variable
-    BasicBlock *InitBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+    // With an integral constant start and step the induction variable is an
+    // i64, which scalar evolution understands. If the end is a constant too,
+    // the exit test is an integer compare and the trip count is known.
+    double StartC, StepC = 1.0, EndC;
+    bool IntIV = Start->getConstant(StartC) && isSmallInteger(StartC) &&
+                 (!Step || Step->getConstant(StepC)) && isSmallInteger(StepC);
+    bool IntExit = IntIV && End->getConstant(EndC) && std::fabs(EndC) < 9007199254740992.0;
 
-    // Branch into InitBB
-    Builder.CreateBr(InitBB);
+    Value *OldVal = NamedValues[VarName];
 
-    // Now, builder is inside the InitBB
-    Builder.SetInsertPoint(InitBB);
+    // i < end, for the double value of i or, for a constant end, as integers:
+    // an integral i is less than end exactly when it is less than ceil(end).
+    auto EmitExitTest = [&](Value *IV, Value *Var) -> Value * {
+        NamedValues[VarName] = Var;
+        if (IntExit)
+            return Builder.CreateICmpSLT(IV, ConstantInt::get(Int64Ty, (int64_t) std::ceil(EndC)),
+                                         "loopcond");
+        Value *EndVal = End->codegen();
+        if (!EndVal)
+            return nullptr;
+        return Builder.CreateFCmpULT(Var, EndVal, "loopcond");
+    };
 
-    // Start the PHI node with an entry for StartVal.
-    PHINode *Variable =
-            Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, VarName);
-    Variable->addIncoming(StartVal, EntryBB);
+    Value *StartIV = IntIV ? ConstantInt::get(Int64Ty, (int64_t) StartC) : StartVal;
+    Value *GuardCond = EmitExitTest(StartIV, StartVal);
+    if (!GuardCond)
+        return nullptr;
 
-    Value *OldVal = NamedValues[VarName];
+    BasicBlock *PreheaderBB = BasicBlock::Create(TheContext, "loop.ph", TheFunction);
+    BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+    BasicBlock *LatchBB = BasicBlock::Create(TheContext, "loop.latch");
+    BasicBlock *ExitBB = BasicBlock::Create(TheContext, "loop.exit");
+    BasicBlock *AfterBB = BasicBlock::Create(TheContext, "afterloop");
+    Builder.CreateCondBr(GuardCond, PreheaderBB, AfterBB);
+
+    Builder.SetInsertPoint(PreheaderBB);
+    Builder.CreateBr(LoopBB);
+
+    // The induction variable, starting at StartVal.
+    Builder.SetInsertPoint(LoopBB);
+    PHINode *IV = Builder.CreatePHI(IntIV ? Int64Ty : DoubleTy, 2, IntIV ? VarName + ".iv" : VarName);
+    IV->addIncoming(StartIV, PreheaderBB);
+    Value *Variable = IntIV ? Builder.CreateSIToFP(IV, DoubleTy, VarName) : IV;
     NamedValues[VarName] = Variable;
 
-    Value *EndCond = End->codegen();
-    if (!EndCond)
+    if (!EmitLoopBody(Body, LatchBB, ExitBB))
         return nullptr;
 
-    // Comparing variable to endVar
-    EndCond = Builder.CreateFCmpULT(Variable, EndCond, "loopcond");
+    // Emit the step value and the next value of the variable.
+    TheFunction->getBasicBlockList().push_back(LatchBB);
+    Builder.SetInsertPoint(LatchBB);
+    if (!(IntExit && StepC > 0 && (EndC - StartC) / StepC <= MaxUnpolledTrips))
+        EmitSafepoint();
+    NamedValues[VarName] = Variable;
+    Value *NextIV, *NextVar;
+    if (IntIV) {
+        NextIV = Builder.CreateNSWAdd(IV, ConstantInt::get(Int64Ty, (int64_t) StepC), "nextiv");
+        NextVar = Builder.CreateSIToFP(NextIV, DoubleTy, "nextvar");
+    } else {
+        Value *StepVal = ConstantFP::get(TheContext, APFloat(1.0)); // If not specified, use 1.0.
+        if (Step && !(StepVal = Step->codegen()))
+            return nullptr;
+        NextIV = NextVar = Builder.CreateFAdd(Variable, StepVal, "nextvar");
+    }
+
+    Value *LatchCond = EmitExitTest(NextIV, NextVar);
+    if (!LatchCond)
+        return nullptr;
+    Builder.CreateCondBr(LatchCond, LoopBB, ExitBB)->setMetadata(LLVMContext::MD_loop, getLoopID(Hints));
 
-    // Create the "after loop" block and insert it.
-    BasicBlock *loopBB  = BasicBlock::Create(TheContext, "loop",TheFunction);
+    // Add a new entry to the PHI node for the backedge.
+    IV->addIncoming(NextIV, Builder.GetInsertBlock());
 
-    BasicBlock *AfterBB =
-            BasicBlock::Create(TheContext, "afterloop", TheFunction);
+    TheFunction->getBasicBlockList().push_back(ExitBB);
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateBr(AfterBB);
+    TheFunction->getBasicBlockList().push_back(AfterBB);
+    Builder.SetInsertPoint(AfterBB);
 
-    Builder.CreateCondBr(EndCond, loopBB, AfterBB);
+    // Restore the OldVal or erase it due to the outer scope doesn't have the variable.
+    if (OldVal)
+        NamedValues[VarName] = OldVal;
+    else
+        NamedValues.erase(VarName);
 
-    Builder.SetInsertPoint(loopBB);
+    // for expr always returns 0.0.
+    return Constant::getNullValue(DoubleTy);
+}
 
-    for (unsigned i = 0; i < Body.size();i++){
-        Body[i]->codegen();
+/// codegenTiled - Emit a loop annotated with @tile(T) as a loop over blocks of
+/// T iterations around a loop over the iterations of a block. If the body is
+/// just another tiled loop, the nest is tiled as a whole: the loops over
+/// blocks go around all the loops over iterations, so two loops walk T x T
+/// tiles. The ends are evaluated once, before the nest, which is why the end
+/// of a loop can't use the variables of the nest, and why a break can't leave
+/// a loop of a nest.
+Value *ForExprAST::codegenTiled() {
+    // The loops of the nest, outermost first.
+    std::vector<ForExprAST *> Nest = {this};
+    while (Nest.back()->Body.size() == 1 && Nest.back()->Body[0]) {
+        ForExprAST *Inner = Nest.back()->Body[0]->getForLoop();
+        if (!Inner || Inner->Hints.Tile <= 1)
+            break;
+        Nest.push_back(Inner);
     }
 
-    // Emit the step value.
-    Value *StepVal = nullptr;
-    if (Step) {
-        StepVal = Step->codegen();
-        if (!StepVal)
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Type *DoubleTy = Type::getDoubleTy(TheContext);
+    Type *Int64Ty = Type::getInt64Ty(TheContext);
+
+    /// TiledLoop - One loop of the nest, as a loop over blocks and a loop over
+    /// the iterations of a block.
+    struct TiledLoop {
+        ForExprAST *Loop;
+        int64_t Start, Step, Span; // Span is the step of the loop over blocks.
+        Value *End;
+        PHINode *TileIV, *IV;
+        Value *TileEnd, *OldVal;
+        BasicBlock *TileHeader, *Header;
+    };
+    std::vector<TiledLoop> Loops;
+
+    // The induction variables are i64. An integral i is less than end exactly
+    // when it is less than ceil(end), clamped to the integers doubles hold.
+    const double Limit = 9007199254740992.0;
+    Value *Upper = ConstantFP::get(DoubleTy, Limit), *Lower = ConstantFP::get(DoubleTy, -Limit);
+    Function *Ceil = Intrinsic::getDeclaration(TheModule.get(), Intrinsic::ceil, {DoubleTy});
+    Value *Guard = nullptr; // Every loop runs at least once.
+
+    // While the ends are evaluated the variables of the nest are bound to
+    // placeholders, so an end reading one is caught instead of reading a
+    // variable of the same name from outside the nest.
+    std::map<std::string, Value *> OuterVals;
+    std::vector<Instruction *> Placeholders;
+    for (ForExprAST *L : Nest) {
+        OuterVals.insert({L->VarName, NamedValues[L->VarName]});
+        Value *Undef = UndefValue::get(DoubleTy);
+        Placeholders.push_back(BinaryOperator::CreateFAdd(Undef, Undef, L->VarName));
+        NamedValues[L->VarName] = Placeholders.back();
+    }
+    auto DropPlaceholders = [&] {
+        for (auto &V : OuterVals)
+            NamedValues[V.first] = V.second;
+        for (Instruction *P : Placeholders) {
+            P->replaceAllUsesWith(UndefValue::get(DoubleTy));
+            P->deleteValue();
+        }
+        Placeholders.clear();
+    };
+
+    for (ForExprAST *L : Nest) {
+        double StartC, StepC = 1.0;
+        if (!L->Start->getConstant(StartC) || !isSmallInteger(StartC) ||
+            (L->Step && !L->Step->getConstant(StepC)) || !isSmallInteger(StepC) || StepC <= 0) {
+            DropPlaceholders();
+            return LogErrorV("@tile needs a loop with a constant integer start and step, the step positive");
+        }
+        Value *EndVal = L->End->codegen();
+        if (!EndVal) {
+            DropPlaceholders();
             return nullptr;
-    } else {
-        // If not specified, use 1.0.
-        StepVal = ConstantFP::get(TheContext, APFloat(1.0));
+        }
+        for (Instruction *P : Placeholders)
+            if (EndVal == P || !P->use_empty()) {
+                std::string Name = P->getName().str();
+                DropPlaceholders();
+                return LogErrorV(("the end of a loop in a tiled nest can't use " + Name +
+                                  ", the nest's ends are computed before its loops run").c_str());
+            }
+        EndVal = Builder.CreateCall(Ceil, EndVal);
+        EndVal = Builder.CreateSelect(Builder.CreateFCmpOLT(EndVal, Upper), EndVal, Upper);
+        EndVal = Builder.CreateSelect(Builder.CreateFCmpOGT(EndVal, Lower), EndVal, Lower);
+        Value *End = Builder.CreateFPToSI(EndVal, Int64Ty, L->VarName + ".end");
+
+        int64_t Start = (int64_t) StartC, Step = (int64_t) StepC;
+        int64_t Span = (int64_t) std::min(StepC * L->Hints.Tile, Limit);
+        Value *Runs = Builder.CreateICmpSLT(ConstantInt::get(Int64Ty, Start), End);
+        Guard = Guard ? Builder.CreateAnd(Guard, Runs) : Runs;
+        Loops.push_back({L, Start, Step, Span, End, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr});
+    }
+    DropPlaceholders();
+
+    BasicBlock *ExitBB = BasicBlock::Create(TheContext, "tile.exit");
+    BasicBlock *AfterBB = BasicBlock::Create(TheContext, "aftertile");
+
+    // OpenLoop - Branch to a new loop through its preheader, or past the nest
+    // unless Enter holds, and start the header with a phi for the variable.
+    auto OpenLoop = [&](Value *Enter, Value *Init, const std::string &Name, const std::string &IVName,
+                        BasicBlock *&Header) {
+        BasicBlock *PreheaderBB = BasicBlock::Create(TheContext, Name + ".ph", TheFunction);
+        Header = BasicBlock::Create(TheContext, Name, TheFunction);
+        if (Enter)
+            Builder.CreateCondBr(Enter, PreheaderBB, AfterBB);
+        else
+            Builder.CreateBr(PreheaderBB);
+        Builder.SetInsertPoint(PreheaderBB);
+        Builder.CreateBr(Header);
+        Builder.SetInsertPoint(Header);
+        PHINode *IV = Builder.CreatePHI(Int64Ty, 2, IVName);
+        IV->addIncoming(Init, PreheaderBB);
+        return IV;
+    };
+
+    // The loops over blocks, then the loops over the iterations of a block.
+    for (TiledLoop &L : Loops) {
+        L.TileIV = OpenLoop(&L == &Loops.front() ? Guard : nullptr, ConstantInt::get(Int64Ty, L.Start), "tile",
+                            L.Loop->VarName + ".tile", L.TileHeader);
+        Value *Next = Builder.CreateNSWAdd(L.TileIV, ConstantInt::get(Int64Ty, L.Span));
+        L.TileEnd = Builder.CreateSelect(Builder.CreateICmpSLT(Next, L.End), Next, L.End,
+                                         L.Loop->VarName + ".tile.end");
+    }
+    for (TiledLoop &L : Loops) {
+        L.IV = OpenLoop(nullptr, L.TileIV, "loop", L.Loop->VarName + ".iv", L.Header);
+        L.OldVal = NamedValues[L.Loop->VarName];
+        NamedValues[L.Loop->VarName] = Builder.CreateSIToFP(L.IV, DoubleTy, L.Loop->VarName);
     }
 
-    // update variable
-    Value *NextVar = Builder.CreateFAdd(Variable, StepVal, "nextvar");
+    // A break in a nest would leave one loop over iterations but none of the
+    // loops over blocks.
+    BasicBlock *LatchBB = BasicBlock::Create(TheContext, "loop.latch");
+    if (!EmitLoopBody(Nest.back()->Body, LatchBB, Loops.size() == 1 ? ExitBB : nullptr))
+        return nullptr;
 
-    Builder.CreateBr(InitBB);
+    // Close the loops innermost first, each one falls out into the latch of
+    // the loop around it. The hints are for the loops over iterations, the
+    // polls for the loops over blocks.
+    struct LoopLatch {
+        PHINode *IV;
+        BasicBlock *Header;
+        int64_t Step;
+        Value *End;
+        MDNode *LoopID;
+        bool Poll;
+    };
+    std::vector<LoopLatch> Latches;
+    for (auto L = Loops.rbegin(); L != Loops.rend(); ++L)
+        Latches.push_back({L->IV, L->Header, L->Step, L->TileEnd, getLoopID(L->Loop->Hints), false});
+    for (auto L = Loops.rbegin(); L != Loops.rend(); ++L)
+        Latches.push_back({L->TileIV, L->TileHeader, L->Span, L->End, nullptr, true});
+    for (LoopLatch &L : Latches) {
+        TheFunction->getBasicBlockList().push_back(LatchBB);
+        Builder.SetInsertPoint(LatchBB);
+        if (L.Poll)
+            EmitSafepoint();
+        Value *Next = Builder.CreateNSWAdd(L.IV, ConstantInt::get(Int64Ty, L.Step), "nextiv");
+        BasicBlock *OuterBB = &L == &Latches.back() ? ExitBB : BasicBlock::Create(TheContext, "tile.latch");
+        Builder.CreateCondBr(Builder.CreateICmpSLT(Next, L.End), L.Header, OuterBB)
+                ->setMetadata(LLVMContext::MD_loop, L.LoopID);
+        L.IV->addIncoming(Next, Builder.GetInsertBlock());
+        LatchBB = OuterBB;
+    }
 
+    TheFunction->getBasicBlockList().push_back(ExitBB);
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateBr(AfterBB);
+    TheFunction->getBasicBlockList().push_back(AfterBB);
     Builder.SetInsertPoint(AfterBB);
 
-    // Add a new entry to the PHI node for the backedge.
-    Variable->addIncoming(NextVar, loopBB);
-
-    // Restore the OldVal or erase it due to the outer scope doesn't have the variable.
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    for (auto L = Loops.rbegin(); L != Loops.rend(); ++L) {
+        if (L->OldVal)
+            NamedValues[L->Loop->VarName] = L->OldVal;
+        else
+            NamedValues.erase(L->Loop->VarName);
+    }
 
     // for expr always returns 0.0.
+    return Constant::getNullValue(DoubleTy);
+}
+
+Value *WhileExprAST::codegen() {
+    EmitLocation(this);
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+    BasicBlock *PreheaderBB = BasicBlock::Create(TheContext, "while.ph");
+    BasicBlock *LoopBB = BasicBlock::Create(TheContext, "while");
+    BasicBlock *LatchBB = BasicBlock::Create(TheContext, "while.latch");
+    BasicBlock *ExitBB = BasicBlock::Create(TheContext, "while.exit");
+    BasicBlock *AfterBB = BasicBlock::Create(TheContext, "afterwhile");
+    if (!Cond->codegenBranch(PreheaderBB, AfterBB))
+        return nullptr;
+
+    TheFunction->getBasicBlockList().push_back(PreheaderBB);
+    Builder.SetInsertPoint(PreheaderBB);
+    Builder.CreateBr(LoopBB);
+
+    TheFunction->getBasicBlockList().push_back(LoopBB);
+    Builder.SetInsertPoint(LoopBB);
+    if (!EmitLoopBody(Body, LatchBB, ExitBB))
+        return nullptr;
+
+    TheFunction->getBasicBlockList().push_back(LatchBB);
+    Builder.SetInsertPoint(LatchBB);
+    EmitSafepoint();
+    if (!Cond->codegenBranch(LoopBB, ExitBB))
+        return nullptr;
+
+    TheFunction->getBasicBlockList().push_back(ExitBB);
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateBr(AfterBB);
+    TheFunction->getBasicBlockList().push_back(AfterBB);
+    Builder.SetInsertPoint(AfterBB);
+
+    // while expr always returns 0.0.
     return Constant::getNullValue(Type::getDoubleTy(TheContext));
 }
 
+/// EmitLoopJump - Branch to Target. Code after a break or continue is
+/// unreachable, it goes into a block of its own that SimplifyCFG removes.
+Value *EmitLoopJump(BasicBlock *Target) {
+    Builder.CreateBr(Target);
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    Builder.SetInsertPoint(BasicBlock::Create(TheContext, "unreachable", TheFunction));
+    return Constant::getNullValue(Type::getDoubleTy(TheContext));
+}
+
+/// EmitLoopExit - Release the region blocks a break or continue leaves.
+void EmitLoopExit(const LoopTarget &Loop) {
+    if (RegionMarks.size() > Loop.RegionDepth)
+        EmitRegionRewind(RegionMarks[Loop.RegionDepth]);
+}
+
+Value *BreakExprAST::codegen() {
+    if (LoopTargets.empty())
+        return LogErrorV("break outside of a loop");
+    if (!LoopTargets.back().Break)
+        return LogErrorV("break can't leave a loop of a tiled nest");
+    EmitLoopExit(LoopTargets.back());
+    return EmitLoopJump(LoopTargets.back().Break);
+}
+
+Value *ContinueExprAST::codegen() {
+    if (LoopTargets.empty())
+        return LogErrorV("continue outside of a loop");
+    EmitLoopExit(LoopTargets.back());
+    return EmitLoopJump(LoopTargets.back().Continue);
+}
@@ -0,0 +1,198 @@
+//
+// Import.cpp - multi-file programs and their compile cache.
+//
+// 'import "file.l"' compiles another file on its own, like a prelude: its
+// definitions go into an object file the JIT maps in, and only the summary of
+// its prototypes is visible to the importer. A file is imported once however
+// often it is named, paths are relative to the importing file. With
+// -import-cache, objects are kept under a key made of the file's text, the
+// prototypes of what it imports and the compiler settings, so an unchanged
+// file is never compiled again, and changing the body of a function only
+// recompiles the files importing it if its prototype changed too.
+//
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/// ImportCache - Directory compiled imports are kept in.
+static cl::opt<std::string> ImportCache("import-cache",
+                                        cl::desc("Keep compiled imports in this directory and reuse them"),
+                                        cl::value_desc("dir"), cl::init(""));
+
+/// ImportFormat - Part of every cache key, change it when the object files or
+/// the prototype summaries change meaning.
+static const char ImportFormat[] = "L import 1";
+
+/// ImportCompiler - Compiles the source of an imported file, whose own imports
+/// are loaded already, into an object file and the summary of its prototypes.
+/// Returns false if there is no object.
+typedef std::function<bool(const std::string &Path, const std::string &Source, SmallVectorImpl<char> &Object,
+                           std::string &Protos)> ImportCompiler;
+
+/// Imported - The interface hash of every file imported so far, by real path.
+static std::map<std::string, std::string> Imported;
+
+/// ImportedProtos - The prototype summary of every file imported so far, by
+/// real path.
+static std::map<std::string, std::string> ImportedProtos;
+
+/// Importing - The files being imported, to catch cycles.
+static std::set<std::string> Importing;
+
+static std::string HashOf(MD5 &Hash) {
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return Result.digest().str().str();
+}
+
+/// ResolveImport - The path of Name imported from the file From.
+static std::string ResolveImport(const std::string &Name, const std::string &From) {
+    if (sys::path::is_absolute(Name))
+        return Name;
+    SmallString<256> Path(sys::path::parent_path(From));
+    sys::path::append(Path, Name);
+    return Path.str().str();
+}
+
+/// ScanImports - The names Source imports, found with the lexer so they are
+/// exactly the ones compiling it will ask for.
+static std::vector<std::string> ScanImports(const std::string &Path, const std::string &Source) {
+    std::vector<std::string> Names;
+    FILE *In = Source.empty() ? nullptr : fmemopen(const_cast<char *>(Source.data()), Source.size(), "r");
+    if (!In)
+        return Names;
+    LexerState Saved = SaveLexerState();
+    SetLexerInput(In, Path);
+    for (int Tok = gettok(); Tok != tok_eof; Tok = gettok())
+        if (Tok == tok_import && gettok() == tok_string)
+            Names.push_back(StringVal);
+    RestoreLexerState(Saved);
+    fclose(In);
+    return Names;
+}
+
+/// WriteCacheFile - Write Data to Path through a temporary file, so another
+/// process never reads half of it.
+static void WriteCacheFile(const std::string &Path, StringRef Data) {
+    std::string Temp = Path + ".tmp" + std::to_string(sys::Process::getProcessId());
+    {
+        std::error_code EC;
+        raw_fd_ostream OS(Temp, EC, sys::fs::OF_None);
+        if (EC)
+            return;
+        OS << Data;
+    }
+    if (sys::fs::rename(Temp, Path))
+        sys::fs::remove(Temp);
+}
+
+static const std::string *ImportPath(const std::string &Path, const std::string &Settings,
+                                     const ImportCompiler &Compile);
+
+/// ImportFile - Import Name, named in the file From, unless it was imported
+/// already. Settings describes the compiler options that change the code.
+/// Returns the interface hash of the file, null on errors.
+const std::string *ImportFile(const std::string &Name, const std::string &From, const std::string &Settings,
+                              const ImportCompiler &Compile) {
+    std::string Path = ResolveImport(Name, From);
+    SmallString<256> Real;
+    if (sys::fs::real_path(Path, Real)) {
+        LogError(("cannot find the imported file " + Path).c_str());
+        return nullptr;
+    }
+    std::string RealPath = Real.str().str();
+    auto I = Imported.find(RealPath);
+    if (I != Imported.end()) {
+        // An import being compiled starts without the prototypes its
+        // dependencies registered before, it gets them back here.
+        if (ImportDepth)
+            RegisterProtos(ImportedProtos[RealPath]);
+        return &I->second;
+    }
+    if (!Importing.insert(RealPath).second) {
+        LogError(("import cycle through " + Path).c_str());
+        return nullptr;
+    }
+    const std::string *Interface = ImportPath(RealPath, Settings, Compile);
+    Importing.erase(RealPath);
+    return Interface;
+}
+
+/// ImportPath - Load the object of the file at Path, compiling it if the
+/// cache doesn't have it, and register its prototypes.
+static const std::string *ImportPath(const std::string &Path, const std::string &Settings,
+                                     const ImportCompiler &Compile) {
+    auto File = MemoryBuffer::getFile(Path);
+    if (!File) {
+        LogError(("cannot read the imported file " + Path).c_str());
+        return nullptr;
+    }
+    std::string Source = (*File)->getBuffer().str();
+
+    // Import the dependencies first, the key has their interfaces.
+    TargetMachine &TM = TheJIT->getTargetMachine();
+    MD5 Key;
+    Key.update(ImportFormat);
+    Key.update(TM.getTargetTriple().str());
+    Key.update(TM.getTargetCPU());
+    Key.update(TM.getTargetFeatureString());
+    Key.update(Settings);
+    for (const std::string &Name : ScanImports(Path, Source)) {
+        const std::string *Interface = ImportFile(Name, Path, Settings, Compile);
+        if (!Interface)
+            return nullptr;
+        Key.update(*Interface);
+    }
+    Key.update(Source);
+    std::string CachePath;
+    if (!ImportCache.empty()) {
+        SmallString<256> P(ImportCache);
+        sys::path::append(P, HashOf(Key));
+        CachePath = P.str().str();
+    }
+
+    std::unique_ptr<MemoryBuffer> Object;
+    std::string Protos;
+    if (!CachePath.empty()) {
+        auto CachedObj = MemoryBuffer::getFile(CachePath + ".o", -1, /*RequiresNullTerminator=*/false);
+        auto CachedProtos = MemoryBuffer::getFile(CachePath + ".protos");
+        if (CachedObj && CachedProtos) {
+            Object = std::move(*CachedObj);
+            Protos = (*CachedProtos)->getBuffer().str();
+        }
+    }
+
+    if (!Object) {
+        SmallVector<char, 0> Obj;
+        unsigned Errors = NumErrors;
+        if (!Compile(Path, Source, Obj, Protos))
+            return nullptr;
+        Object = MemoryBuffer::getMemBufferCopy(StringRef(Obj.data(), Obj.size()), Path);
+        // Code with errors is loaded like the REPL would, but not kept.
+        if (!CachePath.empty() && NumErrors == Errors && !sys::fs::create_directories(ImportCache)) {
+            WriteCacheFile(CachePath + ".o", Object->getBuffer());
+            WriteCacheFile(CachePath + ".protos", Protos);
+        }
+    }
+
+    TheJIT->addObjectFile(std::move(Object));
+    RegisterProtos(Protos);
+    ImportedProtos[Path] = Protos;
+
+    MD5 Interface;
+    Interface.update(Protos);
+    return &(Imported[Path] = HashOf(Interface));
+}
@@ -0,0 +1,73 @@
+//
+// JITListeners.cpp - make JIT'd code visible to debuggers and profilers.
+//
+// GDB always learns about new code through its JIT interface. With -perf,
+// function names go to /tmp/perf-PID.map, which perf reads on its own, and,
+// if LLVM was built with LLVM_USE_PERF, to a jitdump file for
+// `perf inject --jit`, which adds source lines when running with -g.
+//
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include <unistd.h>
+
+using namespace llvm;
+
+/// PerfJIT - Write the perf map and jitdump files.
+static cl::opt<bool> PerfJIT("perf",
+                             cl::desc("Describe JIT'd functions to perf (perf map and jitdump)"),
+                             cl::init(false));
+
+/// PerfMapListener - Appends "address size name" for every JIT'd function to
+/// /tmp/perf-PID.map. Entries are never removed, perf has no way to do that.
+class PerfMapListener : public JITEventListener {
+    FILE *Map;
+
+public:
+    PerfMapListener() {
+        std::string Path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        Map = fopen(Path.c_str(), "w");
+        if (!Map)
+            LogError(("cannot write " + Path).c_str());
+    }
+
+    void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+        if (!Map)
+            return;
+
+        // The debug copy of the object has the sections at their load addresses.
+        object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+        const object::ObjectFile &Loaded = DebugObj.getBinary() ? *DebugObj.getBinary() : Obj;
+        for (const auto &P : object::computeSymbolSizes(Loaded)) {
+            Expected<object::SymbolRef::Type> Type = P.first.getType();
+            if (!Type || *Type != object::SymbolRef::ST_Function) {
+                consumeError(Type.takeError());
+                continue;
+            }
+            Expected<StringRef> Name = P.first.getName();
+            Expected<uint64_t> Addr = P.first.getAddress();
+            if (!Name || !Addr) {
+                consumeError(Name.takeError());
+                consumeError(Addr.takeError());
+                continue;
+            }
+            fprintf(Map, "%llx %llx %s\n", (unsigned long long) *Addr,
+                    (unsigned long long) P.second, Name->str().c_str());
+        }
+        fflush(Map);
+    }
+};
+
+/// RegisterJITEventListeners - Hook the debugger and profiler listeners into
+/// TheJIT, before anything is compiled.
+void RegisterJITEventListeners() {
+    TheJIT->registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+    if (!PerfJIT)
+        return;
+
+    static PerfMapListener PerfMap;
+    TheJIT->registerJITEventListener(PerfMap);
+    if (JITEventListener *JITDump = JITEventListener::createPerfJITEventListener())
+        TheJIT->registerJITEventListener(*JITDump);
+}
@@ -13,9 +13,12 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -26,57 +29,180 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 namespace llvm {
 namespace orc {
 
+// All members are safe to call from any thread. Adding, removing and looking
+// up modules is serialized by one lock; calls through a FunctionSlot never take
+// it, so compiled code keeps running while new definitions are compiled.
 class KaleidoscopeJIT {
 public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
+  /// FunctionSlot - Address of the newest published version of a function.
+  using FunctionSlot = std::atomic<JITTargetAddress>;
+
   KaleidoscopeJIT()
       : Resolver(createLegacyLookupResolver(
             ES,
             [this](const std::string &Name) { return findMangledSymbol(Name); },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+        TM(EngineBuilder()
+               .setMCPU(sys::getHostCPUName())
+               .setMAttrs(getHostFeatures())
+               .selectTarget()),
+        DL(TM->createDataLayout()),
         ObjectLayer(AcknowledgeORCv1Deprecation, ES,
                     [this](VModuleKey) {
                       return ObjLayerT::Resources{
                           std::make_shared<SectionMemoryManager>(), Resolver};
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &Info) {
+                      for (auto *L : EventListeners)
+                        L->notifyObjectLoaded(K, Obj, Info);
+                    },
+                    ObjLayerT::NotifyFinalizedFtor(),
+                    [this](VModuleKey K, const object::ObjectFile &) {
+                      for (auto *L : EventListeners)
+                        L->notifyFreeingObject(K);
                     }),
         CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
                      SimpleCompiler(*TM)) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    for (auto &Head : SlotBuckets)
+      Head.store(nullptr, std::memory_order_relaxed);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
-  VModuleKey addModule(std::unique_ptr<Module> M) {
+  /// registerJITEventListener - Tell L about every object that is linked or
+  /// freed from now on.
+  void registerJITEventListener(JITEventListener &L) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    EventListeners.push_back(&L);
+  }
+
+  /// addModule - Compile M at backend optimization level Level.
+  VModuleKey addModule(std::unique_ptr<Module> M,
+                       CodeGenOpt::Level Level = CodeGenOpt::Default) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    TM->setOptLevel(Level);
     auto K = ES.allocateVModule();
     cantFail(CompileLayer.addModule(K, std::move(M)));
     ModuleKeys.push_back(K);
     return K;
   }
 
+  VModuleKey addObjectFile(std::unique_ptr<MemoryBuffer> Obj) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    auto K = ES.allocateVModule();
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    ModuleKeys.push_back(K);
+    return K;
+  }
+
   void removeModule(VModuleKey K) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
     ModuleKeys.erase(find(ModuleKeys, K));
     cantFail(CompileLayer.removeModule(K));
   }
 
+  /// defineSymbol - Resolve Name to Addr, ahead of the symbols of the host
+  /// process. Used for host functions that are not exported.
+  void defineSymbol(const std::string &Name, JITTargetAddress Addr) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    HostSymbols[mangle(Name)] = Addr;
+  }
+
   JITSymbol findSymbol(const std::string Name) {
     return findMangledSymbol(mangle(Name));
   }
 
+  /// getSymbolAddress - Link module K if needed and return the address of
+  /// Name in it, or 0. Unlike findSymbol this can't pick up a same-named
+  /// symbol another thread added meanwhile.
+  JITTargetAddress getSymbolAddress(VModuleKey K, const std::string &Name) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    if (auto Sym = CompileLayer.findSymbolIn(K, mangle(Name), ExportedSymbolsOnly))
+      return cantFail(Sym.getAddress());
+    return 0;
+  }
+
+  /// publishFunction - Link Name from module K and point its slot at it.
+  /// Threads calling through the slot switch to the new version on their
+  /// next call. A version with another Signature gets a slot of its own, code
+  /// calling through the old slot keeps calling the old version.
+  void publishFunction(VModuleKey K, const std::string &Name,
+                       const std::string &Signature) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    JITTargetAddress Addr = getSymbolAddress(K, Name);
+    if (!Addr)
+      return;
+
+    PublishedSlot *Current = findSlot(Name);
+    if (Current && Current->Signature == Signature) {
+      Current->Slot.store(Addr, std::memory_order_release);
+      return;
+    }
+
+    // A new slot goes in front of its bucket, where it hides the old slot of
+    // the name. Readers may still be walking past the old one, so slots live
+    // as long as the JIT.
+    auto &Head = SlotBuckets[getSlotBucket(Name)];
+    SlotStorage.push_back(llvm::make_unique<PublishedSlot>(
+        Name, Signature, Addr, Head.load(std::memory_order_relaxed)));
+    Head.store(SlotStorage.back().get(), std::memory_order_release);
+  }
+
+  /// redirectFunction - Point the slot of Name at the version of Target
+  /// published last, if both slots hold versions of the same type. Code
+  /// calling Name calls Target from its next call on.
+  void redirectFunction(const std::string &Name, const std::string &Target) {
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+    PublishedSlot *From = findSlot(Name), *To = findSlot(Target);
+    if (!From || !To || From->Signature != To->Signature)
+      return;
+    From->Slot.store(To->Slot.load(std::memory_order_relaxed),
+                     std::memory_order_release);
+  }
+
+  /// getFunctionSlot - The slot of the published function Name, or null.
+  /// With a Signature, only a slot for versions of that type. Lock-free,
+  /// callers may keep the slot and load it before every call.
+  const FunctionSlot *getFunctionSlot(const std::string &Name,
+                                      const std::string *Signature = nullptr) const {
+    PublishedSlot *Current = findSlot(Name);
+    if (!Current || (Signature && Current->Signature != *Signature))
+      return nullptr;
+    return &Current->Slot;
+  }
+
 private:
+  /// getHostFeatures - The CPU features of this machine, so vector code uses
+  /// the widest registers it has.
+  static std::vector<std::string> getHostFeatures() {
+    std::vector<std::string> Features;
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures))
+      for (auto &F : HostFeatures)
+        Features.push_back((F.second ? "+" : "-") + F.first().str());
+    return Features;
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -86,20 +212,23 @@ private:
     return MangledName;
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
 #ifdef _WIN32
-    // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
-    // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
-    //
-    // But for Windows COFF objects, this flag is currently never set.
-    // For a potential solution see: https://reviews.llvm.org/rL258665
-    // For now, we allow non-exported symbols on Windows as a workaround.
-    const bool ExportedSymbolsOnly = false;
+  // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
+  // flag to decide whether a symbol will be visible or not, when we call
+  // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
+  //
+  // But for Windows COFF objects, this flag is currently never set.
+  // For a potential solution see: https://reviews.llvm.org/rL258665
+  // For now, we allow non-exported symbols on Windows as a workaround.
+  static const bool ExportedSymbolsOnly = false;
 #else
-    const bool ExportedSymbolsOnly = true;
+  static const bool ExportedSymbolsOnly = true;
 #endif
 
+  JITSymbol findMangledSymbol(const std::string &Name) {
+    // Also called back by the resolver while linking, with the lock held.
+    std::lock_guard<std::recursive_mutex> Guard(Lock);
+
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
@@ -107,6 +236,11 @@ private:
       if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
         return Sym;
 
+    // Then the symbols the host defined explicitly.
+    auto HI = HostSymbols.find(Name);
+    if (HI != HostSymbols.end())
+      return JITSymbol(HI->second, JITSymbolFlags::Exported);
+
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
@@ -131,6 +265,40 @@ private:
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
   std::vector<VModuleKey> ModuleKeys;
+  std::vector<JITEventListener *> EventListeners;
+  std::map<std::string, JITTargetAddress> HostSymbols;
+
+  /// PublishedSlot - The slot of a function and the type of the versions it
+  /// holds, in the chain of its bucket. Slots are only ever added in front
+  /// of a chain and never freed, so readers walk the chains without the lock.
+  struct PublishedSlot {
+    std::string Name, Signature;
+    FunctionSlot Slot;
+    PublishedSlot *Next;
+
+    PublishedSlot(const std::string &Name, const std::string &Signature,
+                  JITTargetAddress Addr, PublishedSlot *Next)
+        : Name(Name), Signature(Signature), Slot(Addr), Next(Next) {}
+  };
+
+  static const unsigned NumSlotBuckets = 4096;
+
+  static unsigned getSlotBucket(StringRef Name) {
+    return hash_value(Name) % NumSlotBuckets;
+  }
+
+  /// findSlot - The newest slot of Name, or null. Lock-free.
+  PublishedSlot *findSlot(const std::string &Name) const {
+    for (PublishedSlot *S = SlotBuckets[getSlotBucket(Name)].load(std::memory_order_acquire);
+         S; S = S->Next)
+      if (S->Name == Name)
+        return S;
+    return nullptr;
+  }
+
+  std::recursive_mutex Lock;
+  std::atomic<PublishedSlot *> SlotBuckets[NumSlotBuckets];
+  std::vector<std::unique_ptr<PublishedSlot>> SlotStorage;
 };
 
 } // end namespace orc
@@ -2,6 +2,9 @@
 // Created by lee on 2019-10-28.
 //
 
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
 
 /**
@@ -27,11 +30,101 @@ enum Token {
     tok_else = -9,
 
     tok_for = -10,
-    tok_in = -11
+    tok_in = -11,
+
+    tok_memo = -12,
+    tok_fast = -13,
+
+    tok_while = -14,
+    tok_break = -15,
+    tok_continue = -16,
+
+    // two-character operators
+    tok_and = -17,  // &&
+    tok_or = -18,   // ||
+    tok_eq = -19,   // ==
+    tok_ne = -20,   // !=
+    tok_le = -21,   // <=
+    tok_ge = -22,   // >=
+
+    tok_import = -23,
+    tok_string = -24,
+
+    tok_struct = -25,
+    tok_region = -26
 };
 
 std::string IdentifierStr;  ///IdentifierStr - This always point to the current token.
 double NumVal;
+std::string StringVal;      ///StringVal - The contents of a tok_string, without the quotes.
+
+/// Input - Where gettok reads source from, InputName names it in debug info.
+FILE *Input = stdin;
+std::string InputName = "<stdin>";
+
+/// ImportDepth - How many imported files are being compiled, see Import.cpp.
+unsigned ImportDepth = 0;
+
+/// LastChar - The character read ahead of the current token.
+static int LastChar = ' ';
+
+/// SourceLocation - A position in the input, lines count from 1.
+struct SourceLocation {
+    int Line;
+    int Col;
+};
+
+/// CurLoc - Where the current token starts.
+SourceLocation CurLoc;
+
+/// LexLoc - Where LastChar is.
+static SourceLocation LexLoc = {1, 0};
+
+/// advance - Read the next character, keeping track of its location.
+static int advance() {
+    int C = getc(Input);
+    if (C == '\n') {
+        LexLoc.Line++;
+        LexLoc.Col = 0;
+    } else {
+        LexLoc.Col++;
+    }
+    return C;
+}
+
+/// SetLexerInput - Start lexing a new stream, dropping any read-ahead.
+void SetLexerInput(FILE *F, const std::string &Name) {
+    Input = F;
+    InputName = Name;
+    LastChar = ' ';
+    LexLoc = {1, 0};
+}
+
+/// LexerState - Where gettok is in its input and the value of the token it
+/// returned last, so another input can be lexed in between.
+struct LexerState {
+    FILE *Input;
+    std::string InputName;
+    int LastChar;
+    SourceLocation CurLoc, LexLoc;
+    std::string IdentifierStr, StringVal;
+    double NumVal;
+};
+
+LexerState SaveLexerState() {
+    return {Input, InputName, LastChar, CurLoc, LexLoc, IdentifierStr, StringVal, NumVal};
+}
+
+void RestoreLexerState(const LexerState &S) {
+    Input = S.Input;
+    InputName = S.InputName;
+    LastChar = S.LastChar;
+    CurLoc = S.CurLoc;
+    LexLoc = S.LexLoc;
+    IdentifierStr = S.IdentifierStr;
+    StringVal = S.StringVal;
+    NumVal = S.NumVal;
+}
 
 /**
  * @brief gettok() will skip whitespace and comments, and simply separate out each word.
@@ -40,15 +133,15 @@ double NumVal;
  * @return token number
  */
 int gettok() {
-    static int LastChar = ' ';
-
     // Skip any whitespace.
     while (isspace(LastChar))
-        LastChar = getchar();
+        LastChar = advance();
+
+    CurLoc = LexLoc;
 
     if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
         IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
+        while (isalnum((LastChar = advance())))
             IdentifierStr += LastChar;
         if (IdentifierStr == "def")
             return tok_def;
@@ -66,6 +159,22 @@ int gettok() {
             return tok_for;
         if (IdentifierStr == "in")
             return tok_in;
+        if (IdentifierStr == "memo")
+            return tok_memo;
+        if (IdentifierStr == "fast")
+            return tok_fast;
+        if (IdentifierStr == "while")
+            return tok_while;
+        if (IdentifierStr == "break")
+            return tok_break;
+        if (IdentifierStr == "continue")
+            return tok_continue;
+        if (IdentifierStr == "import")
+            return tok_import;
+        if (IdentifierStr == "struct")
+            return tok_struct;
+        if (IdentifierStr == "region")
+            return tok_region;
 
         return tok_identifier;
     }
@@ -73,15 +182,26 @@ int gettok() {
         std::string NumStr;
         do {
             NumStr += LastChar;
-            LastChar = getchar();
+            LastChar = advance();
         } while (isdigit(LastChar) || LastChar == '.');
+        // A lone '.' selects a field, "ps[i].x".
+        if (NumStr == ".")
+            return '.';
         NumVal = strtod(NumStr.c_str(), nullptr);
         return tok_number;
     }
+    if (LastChar == '"') { // String: "[^"\n]*"
+        StringVal.clear();
+        while ((LastChar = advance()) != '"' && LastChar != '\n' && LastChar != EOF)
+            StringVal += LastChar;
+        if (LastChar == '"')
+            LastChar = advance();
+        return tok_string;
+    }
     if (LastChar == '#') {
         // Comment until end of line.
         do
-            LastChar = getchar();
+            LastChar = advance();
         while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if (LastChar != EOF)
@@ -93,6 +213,27 @@ int gettok() {
         return tok_eof;
     // Otherwise, just return the character as its ascii value.
     int ThisChar = LastChar;
-    LastChar = getchar();
+    LastChar = advance();
+
+    // Unless it starts a two-character operator.
+    int TwoCharTok = 0;
+    if (ThisChar == '&' && LastChar == '&')
+        TwoCharTok = tok_and;
+    else if (ThisChar == '|' && LastChar == '|')
+        TwoCharTok = tok_or;
+    else if (LastChar == '=') {
+        if (ThisChar == '=')
+            TwoCharTok = tok_eq;
+        else if (ThisChar == '!')
+            TwoCharTok = tok_ne;
+        else if (ThisChar == '<')
+            TwoCharTok = tok_le;
+        else if (ThisChar == '>')
+            TwoCharTok = tok_ge;
+    }
+    if (TwoCharTok) {
+        LastChar = advance();
+        return TwoCharTok;
+    }
     return ThisChar;
 }
\ No newline at end of file
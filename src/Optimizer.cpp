@@ -0,0 +1,148 @@
+//
+// Optimizer.cpp - pass pipelines that work on more than one function.
+//
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize.h"
+
+using namespace llvm;
+
+//----------------------------------------------------------------------
+// Target information
+//----------------------------------------------------------------------
+
+/// VecLib - Vector math library the vectorizer may call for the math builtins.
+/// The library itself has to be loaded into the process.
+static cl::opt<TargetLibraryInfoImpl::VectorLibrary> VecLib(
+        "veclib", cl::desc("Vector math library for vectorized math builtins"),
+        cl::init(TargetLibraryInfoImpl::NoLibrary),
+        cl::values(clEnumValN(TargetLibraryInfoImpl::NoLibrary, "none", "No vector math library"),
+                   clEnumValN(TargetLibraryInfoImpl::Accelerate, "Accelerate", "Apple Accelerate"),
+                   clEnumValN(TargetLibraryInfoImpl::SVML, "SVML", "Intel SVML")));
+
+/// AddTargetAnalyses - Let the passes in PM see the host's library functions
+/// and cost model, without them the vectorizers assume no vector registers.
+void AddTargetAnalyses(legacy::PassManagerBase &PM, Module &M) {
+    TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+    TLII.addVectorizableFunctionsFromVecLib(VecLib);
+    PM.add(new TargetLibraryInfoWrapperPass(TLII));
+    PM.add(createTargetTransformInfoWrapperPass(TheJIT->getTargetMachine().getTargetIRAnalysis()));
+}
+
+/// AddLoopPasses - Optimize, vectorize and unroll loops, then vectorize
+/// straight-line code.
+void AddLoopPasses(legacy::PassManagerBase &PM) {
+    PM.add(createLoopRotatePass());
+    PM.add(createLICMPass());
+    PM.add(createIndVarSimplifyPass());
+    PM.add(createLoopVectorizePass());
+    PM.add(createLoopUnrollPass());
+    PM.add(createSLPVectorizerPass());
+    PM.add(createInstructionCombiningPass());
+}
+
+/// AddFunctionPasses - The pass pipeline of a tier, run on every function as
+/// soon as it is generated.
+void AddFunctionPasses(legacy::FunctionPassManager &FPM, OptTier Tier) {
+    // Promote the variable allocas to SSA registers.
+    FPM.add(createPromoteMemoryToRegisterPass());
+    if (Tier == TierQuick) {
+        // Deep recursion relies on tail calls becoming loops at every tier,
+        // the backend of this tier ignores the tail marker.
+        FPM.add(createCFGSimplificationPass());
+        FPM.add(createTailCallEliminationPass());
+        return;
+    }
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    FPM.add(createInstructionCombiningPass());
+    // Reassociate expressions.
+    FPM.add(createReassociatePass());
+    // Eliminate Common SubExpressions.
+    FPM.add(createGVNPass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    FPM.add(createCFGSimplificationPass());
+    // Turn self-recursive tail calls into loops.
+    FPM.add(createTailCallEliminationPass());
+    if (Tier == TierBasic)
+        return;
+    // Optimize and vectorize loops, math builtins included.
+    AddLoopPasses(FPM);
+}
+
+//----------------------------------------------------------------------
+// Whole-program mode
+//----------------------------------------------------------------------
+
+/// WholeProgram - Keep the bodies of all definitions in one module that is
+/// optimized as a whole, so the inliner and IPO passes see across them.
+static cl::opt<bool> WholeProgram("whole-program",
+                                  cl::desc("Optimize all definitions together, inlining across them"),
+                                  cl::init(false));
+
+/// TheLibrary - The module that holds every definition seen so far in
+/// whole-program mode. It is never handed to the JIT itself.
+std::unique_ptr<Module> TheLibrary;
+
+/// LibraryChanged - TheLibrary has definitions the JIT has not compiled yet.
+static bool LibraryChanged = false;
+
+/// AddToWholeProgram - Link a finished definition module into TheLibrary.
+/// A redefinition replaces the body of the old function.
+void AddToWholeProgram(std::unique_ptr<Module> M) {
+    if (!TheLibrary) {
+        TheLibrary = llvm::make_unique<Module>("whole program", TheContext);
+        TheLibrary->setDataLayout(M->getDataLayout());
+        TheLibrary->setTargetTriple(M->getTargetTriple());
+    }
+
+    // The linker rejects two definitions of one symbol, so turn the old one into
+    // a declaration and let the new body resolve it.
+    for (auto &F : *M) {
+        if (F.isDeclaration())
+            continue;
+        if (Function *Old = TheLibrary->getFunction(F.getName()))
+            if (!Old->isDeclaration())
+                Old->deleteBody();
+    }
+
+    if (Linker::linkModules(*TheLibrary, std::move(M)))
+        LogError("failed to link definition into the whole program");
+    LibraryChanged = true;
+}
+
+/// CompileWholeProgram - If definitions were added since the last call,
+/// optimize a copy of TheLibrary across all of them and hand it to the JIT.
+/// Top-level expressions call into the newest copy, the older ones stay for
+/// code that may still run in them.
+void CompileWholeProgram() {
+    if (!TheLibrary || !LibraryChanged)
+        return;
+    LibraryChanged = false;
+    std::unique_ptr<Module> M = CloneModule(*TheLibrary);
+
+    legacy::PassManager MPM;
+    AddTargetAnalyses(MPM, *M);
+    // Propagate constants into the functions only the library calls.
+    MPM.add(createIPSCCPPass());
+    // Inline the small helpers into their callers.
+    MPM.add(createFunctionInliningPass());
+    MPM.add(createInstructionCombiningPass());
+    MPM.add(createReassociatePass());
+    MPM.add(createGVNPass());
+    MPM.add(createCFGSimplificationPass());
+    // Inlining can expose new self-recursive tail calls.
+    MPM.add(createTailCallEliminationPass());
+    AddLoopPasses(MPM);
+    // Internal helpers that were inlined everywhere are not compiled.
+    MPM.add(createGlobalDCEPass());
+    MPM.run(*M);
+
+    TheJIT->addModule(std::move(M), getCodeGenOptLevel(TierFull));
+}
@@ -2,8 +2,19 @@
 // Created by lee on 2019-10-28.
 //
 
-#include "Codegen.cpp"
 #include "Lexer.cpp"
+#include "Codegen.cpp"
+#include "Simplify.cpp"
+#include "Optimizer.cpp"
+#include "Prelude.cpp"
+#include "Import.cpp"
+#include "Region.cpp"
+#include "Preempt.cpp"
+#include "JITListeners.cpp"
+#include "Server.cpp"
+#include <chrono>
+#include <mutex>
+#include <unistd.h>
 
 using namespace llvm;
 
@@ -15,20 +26,91 @@ static int CurTok;
 static int getNextToken() { return CurTok = gettok(); }
 
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-std::map<char, int> BinopPrecedence;
+/// OpInfo - Precedence and associativity of a binary operator. A precedence of
+/// 0 means the token is not a binary operator.
+struct OpInfo {
+    unsigned char Prec;
+    bool RightAssoc;
+};
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
+/// OpTable - The binary operators, indexed by OpIndex of their token.
+static OpInfo OpTable[256];
 
-    // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0)
+/// OpIndex - Slot of a token in OpTable. ASCII characters index themselves and
+/// the (negative) lexer tokens wrap around to the top of the table, anything
+/// else can't be an operator and gets -1.
+static int OpIndex(int Tok) {
+    if (Tok >= 128 || Tok < -128)
         return -1;
-    return TokPrec;
+    return Tok & 0xff;
+}
+
+/// SetBinopPrecedence - Make Tok a binary operator with the given precedence,
+/// or remove it with a precedence of 0. Returns false if Tok can't be one.
+bool SetBinopPrecedence(int Tok, unsigned Prec, bool RightAssoc = false) {
+    int Index = OpIndex(Tok);
+    if (Index < 0 || Prec > 255)
+        return false;
+    OpTable[Index] = {(unsigned char) Prec, RightAssoc};
+    return true;
+}
+
+/// GetBinop - The operator info for Tok, or null if it isn't a binary operator.
+static const OpInfo *GetBinop(int Tok) {
+    int Index = OpIndex(Tok);
+    if (Index < 0 || !OpTable[Index].Prec)
+        return nullptr;
+    return &OpTable[Index];
+}
+
+/// InstallDefaultOperators - The precedence of the built-in operators.
+static bool InstallDefaultOperators() {
+    SetBinopPrecedence('=', 2, /*RightAssoc=*/true);
+    SetBinopPrecedence(tok_or, 4);
+    SetBinopPrecedence(tok_and, 5);
+    SetBinopPrecedence(tok_eq, 9);
+    SetBinopPrecedence(tok_ne, 9);
+    SetBinopPrecedence('<', 10);
+    SetBinopPrecedence('>', 10);
+    SetBinopPrecedence(tok_le, 10);
+    SetBinopPrecedence(tok_ge, 10);
+    SetBinopPrecedence('+', 20);
+    SetBinopPrecedence('-', 20);
+    SetBinopPrecedence('*', 40);
+    SetBinopPrecedence('/', 40);
+    return true;
+}
+
+static bool DefaultOperatorsInstalled = InstallDefaultOperators();
+
+/// OperatorPrecedence - User overrides of the operator table.
+static cl::list<std::string> OperatorPrecedence("op-prec", cl::CommaSeparated,
+                                                cl::desc("Set operator precedence, e.g. -op-prec='+:30,=:2:right'"),
+                                                cl::value_desc("op:prec[:right]"));
+
+/// ApplyOperatorPrecedence - Install the -op-prec overrides. An operator is
+/// one character or one of the two-character operators the lexer knows.
+void ApplyOperatorPrecedence() {
+    static const std::map<std::string, int> TwoCharOps = {
+            {"&&", tok_and}, {"||", tok_or}, {"==", tok_eq},
+            {"!=", tok_ne}, {"<=", tok_le}, {">=", tok_ge},
+    };
+
+    for (StringRef Entry : OperatorPrecedence) {
+        SmallVector<StringRef, 3> Fields;
+        Entry.split(Fields, ':');
+        unsigned Prec;
+        int Tok = -1;
+        if (Fields[0].size() == 1)
+            Tok = (unsigned char) Fields[0][0];
+        else if (TwoCharOps.count(Fields[0].str()))
+            Tok = TwoCharOps.at(Fields[0].str());
+
+        bool RightAssoc = Fields.size() == 3 && Fields[2] == "right";
+        if (Fields.size() < 2 || Fields.size() > 3 || (Fields.size() == 3 && !RightAssoc) ||
+            Fields[1].getAsInteger(10, Prec) || !SetBinopPrecedence(Tok, Prec, RightAssoc))
+            LogError(("invalid operator precedence '" + Entry + "'").str().c_str());
+    }
 }
 
 
@@ -36,6 +118,8 @@ std::unique_ptr<ExprAST> ParseExpression();
 
 std::unique_ptr<ExprAST> ParseVarDefineExpr();
 
+std::unique_ptr<ExprAST> ParsePrimary();
+
 /// numberexpr ::= number
 std::unique_ptr<ExprAST> ParseNumberExpr() {
     auto Result = llvm::make_unique<NumberExprAST>(NumVal);
@@ -57,14 +141,38 @@ std::unique_ptr<ExprAST> ParseParenExpr() {
 
 /// identifierexpr ::=
 ///     identifier
+///   | identifier '[' expression ']'
+///   | identifier '[' expression ']' '.' identifier
 ///   | identifier '(' expression* ')'
 std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     if (CurTok == tok_return) getNextToken(); // eat return;
+    SourceLocation IdLoc = CurLoc;
     std::string IdName = IdentifierStr;
     getNextToken(); // eat identifier.
 
+    if (CurTok == '[') { // Element of a buffer.
+        SourceLocation IndexLoc = CurLoc;
+        getNextToken(); // eat '['
+        auto Index = ParseExpression();
+        if (!Index)
+            return nullptr;
+        if (CurTok != ']')
+            return LogError("Expected ']' after index");
+        getNextToken(); // eat ']'
+        if (CurTok == '.') { // Field of a record.
+            getNextToken(); // eat '.'
+            if (CurTok != tok_identifier)
+                return LogError("Expected a field name after '.'");
+            std::string Field = IdentifierStr;
+            getNextToken(); // eat the field.
+            return llvm::make_unique<FieldExprAST>(IdName, std::move(Index), Field, IndexLoc);
+        }
+        return llvm::make_unique<IndexExprAST>(llvm::make_unique<VariableExprAST>(IdName, IdLoc),
+                                               std::move(Index), IndexLoc);
+    }
+
     if (CurTok != '(') { // Simple variable ref.
-        return llvm::make_unique<VariableExprAST>(IdName);
+        return llvm::make_unique<VariableExprAST>(IdName, IdLoc);
     }
 
     // Call.
@@ -85,7 +193,7 @@ std::unique_ptr<ExprAST> ParseIdentifierExpr() {
     }
 
     getNextToken(); // eat ')'.
-    return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
+    return llvm::make_unique<CallExprAST>(IdName, std::move(Args), IdLoc);
 }
 
 /// BodyExpr ::= '{' (primary expr)* '}'
@@ -132,7 +240,7 @@ std::unique_ptr<ExprAST> ParseIfElseExpr() { ///@todo Add recursive if expr.
 
 /// Forexpr ::=
 ///         for identifier in (start, end, step) bodyexpr
-std::unique_ptr<ExprAST> ParseForExpr() {
+std::unique_ptr<ExprAST> ParseForExpr(LoopHints Hints = LoopHints()) {
     getNextToken(); // eat for
 
     std::string IdName = IdentifierStr;
@@ -160,13 +268,93 @@ std::unique_ptr<ExprAST> ParseForExpr() {
 
     auto body = ParseBodyExpr();
     return llvm::make_unique<ForExprAST>(IdName, std::move(start), std::move(end),
-                                         std::move(step), std::move(body));
+                                         std::move(step), std::move(body), Hints);
 
 }
+
+/// annotatedloop ::= ('@' identifier '(' number ')')+ forexpr
+std::unique_ptr<ExprAST> ParseAnnotatedLoop() {
+    LoopHints Hints;
+    while (CurTok == '@') {
+        getNextToken(); // eat '@'
+        if (CurTok != tok_identifier)
+            return LogError("Expected a loop annotation after '@'");
+        std::string Name = IdentifierStr;
+        unsigned *Hint = Name == "unroll" ? &Hints.Unroll
+                         : Name == "vectorize" ? &Hints.Vectorize
+                         : Name == "interleave" ? &Hints.Interleave
+                         : Name == "tile" ? &Hints.Tile : nullptr;
+        if (!Hint)
+            return LogError(("Unknown loop annotation @" + Name).c_str());
+        if (getNextToken() != '(')
+            return LogError("Expected '(' after the loop annotation");
+        if (getNextToken() != tok_number || NumVal < 1 || NumVal > 65536 || NumVal != (unsigned) NumVal)
+            return LogError("Expected a positive integer in the loop annotation");
+        unsigned N = (unsigned) NumVal;
+        // The vectorizer ignores widths and interleave counts it can't use.
+        if ((Hint == &Hints.Vectorize && (N & (N - 1) || N > 64)) ||
+            (Hint == &Hints.Interleave && (N & (N - 1) || N > 16)))
+            return LogError(("@" + Name + " takes a power of two up to " +
+                             (Hint == &Hints.Vectorize ? "64" : "16")).c_str());
+        *Hint = N;
+        if (getNextToken() != ')')
+            return LogError("Expected ')' after the loop annotation");
+        getNextToken(); // eat ')'
+    }
+    if (CurTok != tok_for)
+        return LogError("Expected a for loop after the loop annotations");
+    return ParseForExpr(Hints);
+}
+/// Whileexpr ::= while parenexpr bodyexpr
+std::unique_ptr<ExprAST> ParseWhileExpr() {
+    getNextToken(); // eat while
+
+    if (CurTok != '(')
+        return LogError("Expected '(' after while");
+    auto Cond = ParseParenExpr();
+    if (!Cond)
+        return nullptr;
+    if (CurTok != '{')
+        return LogError("Expected '{' after while condition");
+
+    auto body = ParseBodyExpr();
+    return llvm::make_unique<WhileExprAST>(std::move(Cond), std::move(body));
+}
+
+/// breakexpr ::= break
+std::unique_ptr<ExprAST> ParseBreakExpr() {
+    getNextToken(); // eat break
+    return llvm::make_unique<BreakExprAST>();
+}
+
+/// continueexpr ::= continue
+std::unique_ptr<ExprAST> ParseContinueExpr() {
+    getNextToken(); // eat continue
+    return llvm::make_unique<ContinueExprAST>();
+}
+
+/// stringexpr ::= string
+std::unique_ptr<ExprAST> ParseStringExpr() {
+    auto Result = llvm::make_unique<StringExprAST>(StringVal);
+    getNextToken(); // consume the string
+    return std::move(Result);
+}
+
+/// regionexpr ::= 'region' '{' expression* '}'
+std::unique_ptr<ExprAST> ParseRegionExpr() {
+    getNextToken(); // eat region
+    if (CurTok != '{')
+        return LogError("Expected '{' after region");
+    return llvm::make_unique<RegionExprAST>(ParseBodyExpr());
+}
+
 /// primary ::=
 ///     identifierexpr
 ///   | numberexpr
-///   | parenexpr
+///   | stringexpr
+///   | regionexpr
+///   | ifexpr | forexpr | annotatedloop | whileexpr | ...
+/// Parenthesized expressions and '!' are handled by ParseExpression.
 
 std::unique_ptr<ExprAST> ParsePrimary() {
     switch (CurTok) {
@@ -177,8 +365,10 @@ std::unique_ptr<ExprAST> ParsePrimary() {
             return ParseIdentifierExpr();
         case tok_number:
             return ParseNumberExpr();
-        case '(':
-            return ParseParenExpr();
+        case tok_string:
+            return ParseStringExpr();
+        case tok_region:
+            return ParseRegionExpr();
         case tok_return:
             return ParseIdentifierExpr();
         case tok_var:
@@ -187,62 +377,128 @@ std::unique_ptr<ExprAST> ParsePrimary() {
             return ParseIfElseExpr();
         case tok_for:
             return ParseForExpr();
+        case '@':
+            return ParseAnnotatedLoop();
+        case tok_while:
+            return ParseWhileExpr();
+        case tok_break:
+            return ParseBreakExpr();
+        case tok_continue:
+            return ParseContinueExpr();
     }
 }
 
-/// binoprhs ::= ('+' primary)*
-std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                       std::unique_ptr<ExprAST> LHS) {
-    // If this is a binop, find its precedence.
-    while (true) {
-        int TokPrec = GetTokPrecedence();
-
-        // If this is a binop that binds at least as tightly as the current binop,
-        // consume it, otherwise we are done. e.g. if this expression is a signle identifier,
-        //  then the ExprPrec equals to 0, and TokPrec now is -1, so return LHS.
-        if (TokPrec < ExprPrec)
-            return LHS;
-
-        // Okay, we know this is a binop.
-        int BinOp = CurTok;
+/// PendingOp - An operator on ParseExpression's stack: a binary operator
+/// waiting for its right operand, a prefix operator waiting for its operand,
+/// or an open parenthesis.
+struct PendingOp {
+    enum OpKind { Binary, Prefix, Paren } Kind;
+    int Op;
+    unsigned char Prec;
+    SourceLocation Loc;
+};
+
+/// expression ::= operand (binop operand)*
+/// operand ::= '!' operand | '(' expression ')' | primary
+///
+/// Operator precedence parsing driven by OpTable, with explicit operand and
+/// operator stacks: long operator chains and deep parentheses cost heap, not
+/// C++ stack. Primaries that contain expressions (calls, if, ...) recurse.
+/// Does not eat the token that ends the expression.
+std::unique_ptr<ExprAST> ParseExpression() {
+    std::vector<std::unique_ptr<ExprAST>> Operands;
+    std::vector<PendingOp> Ops;
+    unsigned OpenParens = 0;
+
+    // Reduce - Pop the operators that bind tighter than an incoming binary
+    // operator of precedence Prec, stopping at an open parenthesis.
+    auto Reduce = [&](unsigned Prec, bool RightAssoc) {
+        while (!Ops.empty() && Ops.back().Kind != PendingOp::Paren) {
+            PendingOp Top = Ops.back();
+            if (Top.Kind == PendingOp::Binary &&
+                (Top.Prec < Prec || (Top.Prec == Prec && RightAssoc)))
+                return;
+            Ops.pop_back();
+
+            auto RHS = std::move(Operands.back());
+            Operands.pop_back();
+            if (Top.Kind == PendingOp::Prefix) {
+                Operands.push_back(llvm::make_unique<UnaryExprAST>(Top.Op, std::move(RHS), Top.Loc));
+            } else {
+                auto LHS = std::move(Operands.back());
+                Operands.pop_back();
+                Operands.push_back(
+                        llvm::make_unique<BinaryExprAST>(Top.Op, std::move(LHS), std::move(RHS), Top.Loc));
+            }
+        }
+    };
 
-        getNextToken(); // eat binop
+    while (true) {
+        // Operand position: any prefix operators and open parentheses, then a
+        // primary.
+        while (CurTok == '!' || CurTok == '(') {
+            if (CurTok == '(') {
+                Ops.push_back({PendingOp::Paren, '(', 0, CurLoc});
+                ++OpenParens;
+            } else {
+                Ops.push_back({PendingOp::Prefix, '!', 0, CurLoc});
+            }
+            getNextToken();
+        }
 
-        // Parse the primary expression after the binary operator.
-        auto RHS = ParsePrimary();
-        if (!RHS)
+        auto Operand = ParsePrimary();
+        if (!Operand)
             return nullptr;
-
-        // If BinOp binds less tightly with RHS than the operator after RHS, let
-        // the pending operator take RHS as its LHS.
-        if (CurTok != ';') {
-            int NextPrec = GetTokPrecedence();
-            if (TokPrec < NextPrec) {
-                RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-                if (!RHS)
-                    return nullptr;
-            }
+        Operands.push_back(std::move(Operand));
+
+        // Operator position: close our own parentheses, a ')' we didn't open
+        // belongs to the caller.
+        while (CurTok == ')' && OpenParens) {
+            Reduce(0, false);
+            Ops.pop_back(); // the '('
+            --OpenParens;
+            getNextToken(); // eat ')'
         }
-        // Merge LHS/RHS.
 
-        LHS = llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        const OpInfo *Info = GetBinop(CurTok);
+        if (!Info)
+            break;
+        Reduce(Info->Prec, Info->RightAssoc);
+        Ops.push_back({PendingOp::Binary, CurTok, Info->Prec, CurLoc});
+        getNextToken(); // eat binop
     }
-}
 
-/// expression ::= primary binoprhs, not eat ';'
-std::unique_ptr<ExprAST> ParseExpression() {
+    if (OpenParens)
+        return LogError("expected ')'");
+    Reduce(0, false);
+    return std::move(Operands.back());
+}
 
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
-    return ParseBinOpRHS(0, std::move(LHS));
+/// paramtype ::= ('double' | 'int') '*'? | 'handle'
+static bool ParseParamType(ParamType &T) {
+    if (CurTok != tok_identifier) {
+        LogError("Expected a type after ':'");
+        return false;
+    }
+    std::string Name = IdentifierStr;
+    getNextToken(); // eat type name.
+    if (CurTok == '*') {
+        Name += '*';
+        getNextToken(); // eat '*'
+    }
+    if (!getParamTypeByName(Name, T)) {
+        LogError(("Unknown type " + Name).c_str());
+        return false;
+    }
+    return true;
 }
 
-/// prototype ::= id '(' id* ')'
+/// prototype ::= id '(' (id (':' paramtype)?)* ')' (':' paramtype)?
 std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (CurTok != tok_identifier)
         return LogErrorP("Expected function name in prototype");
 
+    SourceLocation FnLoc = CurLoc;
     std::string FnName = IdentifierStr; //get func name
     getNextToken();
 
@@ -250,10 +506,17 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
         return LogErrorP("Expected '(' in prototype");
 
     std::vector<std::string> ArgNames;
+    std::vector<ParamType> ArgTypes;
     getNextToken();
     while (CurTok == tok_identifier) {
         ArgNames.push_back(IdentifierStr);
         getNextToken(); // eat 'IdentifierStr'
+        ArgTypes.push_back(ParamType::Double);
+        if (CurTok == ':') {
+            getNextToken(); // eat ':'
+            if (!ParseParamType(ArgTypes.back()))
+                return nullptr;
+        }
         if (CurTok == ')') break;
         getNextToken(); // eat ','
     }
@@ -261,11 +524,29 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
         return LogErrorP("Expected ')' in prototype");
     // success.
     getNextToken(); // eat ')'.
-    return llvm::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+
+    ParamType RetType = ParamType::Double;
+    if (CurTok == ':') {
+        getNextToken(); // eat ':'
+        if (!ParseParamType(RetType))
+            return nullptr;
+    }
+    return llvm::make_unique<PrototypeAST>(FnName, std::move(ArgNames), FnLoc,
+                                           std::move(ArgTypes), RetType);
 }
 
-/// function definition ::= 'def' prototype expression
+/// function definition ::= ('memo' | 'fast')* 'def' prototype expression
 std::unique_ptr<FunctionAST> ParseDefinition() {
+    bool Memo = false, Fast = false;
+    while (CurTok == tok_memo || CurTok == tok_fast) {
+        if (CurTok == tok_memo)
+            Memo = true;
+        else
+            Fast = true;
+        getNextToken(); // eat memo or fast.
+    }
+    if (CurTok != tok_def)
+        return LogErrorF("Expected 'def' after function modifiers");
     getNextToken(); // eat def.
     auto Proto = ParsePrototype();
     if (!Proto)
@@ -274,15 +555,16 @@ std::unique_ptr<FunctionAST> ParseDefinition() {
         return LogErrorF("Expected '{' in prototype");
     }
     auto E = ParseBodyExpr();
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E), Memo, Fast);
 }
 
 /// toplevelexpr ::= expression
-std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+std::unique_ptr<FunctionAST> ParseTopLevelExpr(const std::string &Name = "__anon_expr") {
+    SourceLocation ExprLoc = CurLoc;
     if (auto E = ParseExpression()) {
         // Make an anonymous proto.
-        auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
-                                                     std::vector<std::string>());
+        auto Proto = llvm::make_unique<PrototypeAST>(Name,
+                                                     std::vector<std::string>(), ExprLoc);
         std::vector<std::unique_ptr<ExprAST>> ExprList;
         ExprList.push_back(std::move(E));
         return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(ExprList));
@@ -296,17 +578,94 @@ std::unique_ptr<PrototypeAST> ParseExtern() {
     return ParsePrototype();
 }
 
+/// struct ::= 'struct' identifier (':' ('aos' | 'soa'))? '{' identifier (',' identifier)* '}'
+std::unique_ptr<StructDecl> ParseStruct() {
+    getNextToken(); // eat struct.
+    if (CurTok != tok_identifier) {
+        LogError("Expected a struct name");
+        return nullptr;
+    }
+    auto Decl = llvm::make_unique<StructDecl>();
+    Decl->Name = IdentifierStr;
+    Decl->Layout = RecordLayout::AoS;
+    getNextToken(); // eat the name.
+
+    if (CurTok == ':') {
+        getNextToken(); // eat ':'
+        if (CurTok != tok_identifier || (IdentifierStr != "aos" && IdentifierStr != "soa")) {
+            LogError("Expected aos or soa after ':'");
+            return nullptr;
+        }
+        Decl->Layout = IdentifierStr == "soa" ? RecordLayout::SoA : RecordLayout::AoS;
+        getNextToken(); // eat the layout.
+    }
+
+    if (CurTok != '{') {
+        LogError("Expected '{' and the fields of the struct");
+        return nullptr;
+    }
+    getNextToken(); // eat '{'
+    while (CurTok == tok_identifier) {
+        if (Decl->getFieldIndex(IdentifierStr) >= 0) {
+            LogError(("Duplicate field " + IdentifierStr).c_str());
+            return nullptr;
+        }
+        Decl->Fields.push_back(IdentifierStr);
+        getNextToken(); // eat the field.
+        if (CurTok != ',')
+            break;
+        getNextToken(); // eat ','
+    }
+    if (CurTok != '}' || Decl->Fields.empty()) {
+        LogError("Expected field names separated by ',' and a '}'");
+        return nullptr;
+    }
+    getNextToken(); // eat '}'
+    return Decl;
+}
+
 /// VarDefineexpr  ::= var Identifer '=' expression
+///                  | var Identifier ':' Identifier '[' expression ']' ('=' expression)?
 std::unique_ptr<ExprAST> ParseVarDefineExpr() {
     getNextToken(); // eat 'var'
     std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
     if (CurTok != tok_identifier)
         return LogError("Expected identifier when define a new variable");
 
+    SourceLocation VarLoc = CurLoc;
     std::string Name = IdentifierStr;
     getNextToken(); // eat IdentifierStr
     std::unique_ptr<ExprAST> Init = nullptr;
 
+    if (CurTok == ':') { // An array of records.
+        getNextToken(); // eat ':'
+        if (CurTok != tok_identifier)
+            return LogError("Expected a struct name after ':'");
+        auto SI = Structs.find(IdentifierStr);
+        if (SI == Structs.end())
+            return LogError(("Unknown struct " + IdentifierStr).c_str());
+        StructDecl Decl = SI->second;
+        getNextToken(); // eat the struct name.
+        if (CurTok != '[')
+            return LogError("Expected '[' and the length of the array");
+        getNextToken(); // eat '['
+        auto Count = ParseExpression();
+        if (!Count)
+            return nullptr;
+        if (CurTok != ']')
+            return LogError("Expected ']' after the length");
+        getNextToken(); // eat ']'
+        if (CurTok == '=') {
+            getNextToken(); // eat '='
+            Init = ParseExpression();
+            if (!Init)
+                return nullptr;
+        }
+        if (CurTok != ';')
+            return LogError("Expected ';' for end the var definition ");
+        return llvm::make_unique<RecordArrayExprAST>(Name, Decl, std::move(Count), std::move(Init), VarLoc);
+    }
+
     if (CurTok == '=') {
         getNextToken(); // eat '='
         Init = ParseExpression();
@@ -329,32 +688,61 @@ static void InitializeModuleAndPassManager() {
     // Open a new module.
     TheModule = llvm::make_unique<Module>("my cool jit", TheContext);
     TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-    // Create a new pass manager attached to it.
-    TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
-
-    // Do simple "peephole" optimizations and bit-twiddling optzns.
-    TheFPM->add(createInstructionCombiningPass());
-    // Reassociate expressions.
-    TheFPM->add(createReassociatePass());
-    // Eliminate Common SubExpressions.
-    TheFPM->add(createGVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    TheFPM->add(createCFGSimplificationPass());
-
-    TheFPM->doInitialization();
+    TheModule->setTargetTriple(TheJIT->getTargetMachine().getTargetTriple().str());
+    InitializeDebugInfo();
+
+    // Create a pass manager for each tier attached to it.
+    for (unsigned Tier = 0; Tier < NumOptTiers; Tier++) {
+        TheFPMs[Tier] = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+        AddTargetAnalyses(*TheFPMs[Tier], *TheModule);
+        AddFunctionPasses(*TheFPMs[Tier], (OptTier) Tier);
+        TheFPMs[Tier]->doInitialization();
+    }
+    ModuleTier = TierQuick;
 }
 
 void HandleDefinition() {
 
     if (auto FnAST = ParseDefinition()) {
-
-        if (auto *FnIR = FnAST->codegen()) {
-
-            fprintf(stderr, "Read function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            TheJIT->addModule(std::move(TheModule));
+        // The memo table lives in this process, a prelude is loaded by others.
+        if (FnAST->isMemo() && !BuildPrelude.empty()) {
+            LogError("memo functions can't be built into a prelude");
+            return;
+        }
+        FnAST->simplify();
+
+        // Imported code is compiled once and cached, it is worth the full tier.
+        if (auto *FnIR = FnAST->codegen(ImportDepth ? TierFull : TierQuick)) {
+
+            std::string IR;
+            raw_string_ostream OS(IR);
+            FnIR->print(OS);
+            OutPrintf("Read function definition:%s\n", OS.str().c_str());
+            // Keep the body around so later calls with constants can be folded.
+            std::string Name = FnIR->getName().str();
+            FunctionDefs[Name] = std::move(FnAST);
+            std::vector<std::string> OldCopies = ForgetSpecializations(Name);
+            FinalizeDebugInfo();
+            if (KeepDefinitions()) {
+                AddToWholeProgram(std::move(TheModule));
+            } else {
+                // Count the calls of code that is not fully optimized, so it
+                // can be recompiled once it is hot.
+                FunctionProfile &Profile = GetProfile(Name);
+                if (Profile.Tier < TierFull)
+                    EmitCallCounter(*FnIR, Profile);
+
+                // Link it now and switch threads calling through its slot
+                // over to the new version.
+                CompileTimer Timer;
+                std::string Signature = getSignature(*FnIR);
+                auto K = TheJIT->addModule(std::move(TheModule), getCodeGenOptLevel(ModuleTier));
+                TheJIT->publishFunction(K, Name, Signature);
+                // Callers compiled earlier call the specialized copies of the
+                // old version, they take the same arguments as the new one.
+                for (const std::string &Copy : OldCopies)
+                    TheJIT->redirectFunction(Copy, Name);
+            }
             InitializeModuleAndPassManager();
         }
     } else {
@@ -363,12 +751,54 @@ void HandleDefinition() {
     }
 }
 
+/// CompileSpecializations - Compile the specialized copies that calls asked
+/// for since the last time. TheModule must be empty.
+void CompileSpecializations() {
+    for (const SpecRequest &R : TakeSpecRequests()) {
+        auto FI = FunctionDefs.find(R.Callee);
+        bool Compiled = !KeepDefinitions() && FI != FunctionDefs.end() && !FI->second->isMemo() &&
+                        FI->second->codegenSpecialization(R.Name, R.Bound);
+        if (Compiled) {
+            FinalizeDebugInfo();
+            CompileTimer Timer;
+            std::string Signature = getSignature(*TheModule->getFunction(R.Name));
+            auto K = TheJIT->addModule(std::move(TheModule), getCodeGenOptLevel(TierFull));
+            TheJIT->publishFunction(K, R.Name, Signature);
+            InitializeModuleAndPassManager();
+        }
+        FinishSpecialization(R, Compiled);
+    }
+}
+
+/// TierUpHotFunctions - Compile the functions that turned out to be hot again
+/// at the full tier. Code linked from now on and callers going through the
+/// function slots get the new version. TheModule must be empty.
+void TierUpHotFunctions() {
+    if (KeepDefinitions())
+        return;
+    for (const std::string &Name : TakeHotFunctions()) {
+        auto FI = FunctionDefs.find(Name);
+        Function *F = FI == FunctionDefs.end() ? nullptr : FI->second->codegen(TierFull);
+        if (!F)
+            continue;
+        FinalizeDebugInfo();
+        CompileTimer Timer;
+        std::string Signature = getSignature(*F);
+        auto K = TheJIT->addModule(std::move(TheModule), getCodeGenOptLevel(TierFull));
+        TheJIT->publishFunction(K, Name, Signature);
+        InitializeModuleAndPassManager();
+    }
+}
+
 void HandleExtern() {
     if (auto ProtoAST = ParseExtern()) {
         if (auto *FnIR = ProtoAST->codegen()) {
-            fprintf(stderr, "Read extern: ");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
+            std::string IR;
+            raw_string_ostream OS(IR);
+            FnIR->print(OS);
+            OutPrintf("Read extern: %s\n", OS.str().c_str());
+            // Later modules declare it again from the prototype.
+            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
         }
     } else {
         // Skip token for error recovery.
@@ -376,26 +806,123 @@ void HandleExtern() {
     }
 }
 
-void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (FnAST->codegen()) {
-            // JIT the module containing the anonymous expression, keeping a handle so
-            // we can free it later.
-            auto H = TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPassManager();
+void HandleStruct() {
+    if (auto Decl = ParseStruct()) {
+        OutPrintf("Read struct %s: %s, %u fields\n", Decl->Name.c_str(),
+                  Decl->Layout == RecordLayout::SoA ? "soa" : "aos", (unsigned) Decl->Fields.size());
+        // Functions compiled from now on use the new declaration.
+        Structs[Decl->Name] = std::move(*Decl);
+    } else {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
 
-            // Search the JIT for the __anon_expr symbol.
-            auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-            assert(ExprSymbol && "Function not found");
+/// BatchSize - How many top-level expressions share one module.
+static cl::opt<unsigned> BatchSize("batch",
+                                   cl::desc("Compile up to N consecutive top-level expressions as one module"),
+                                   cl::init(1));
+
+/// BatchWindow - Flush a batch once its first expression is this old.
+static cl::opt<unsigned> BatchWindow("batch-window",
+                                     cl::desc("Flush a batch of top-level expressions after this many "
+                                              "milliseconds (0 for no limit)"),
+                                     cl::init(0));
+
+/// PendingExprs - Entry points in TheModule that have not run yet, in order.
+std::vector<std::string> PendingExprs;
+std::chrono::steady_clock::time_point BatchStart;
+
+/// CompilerLock - Lexer, parser, codegen and module state are global, so only
+/// the thread holding this lock may use them. It is held while reading input,
+/// but not while compiled code runs.
+std::mutex CompilerLock;
+
+/// FlushTopLevelExprs - Compile the pending top-level expressions as one
+/// module, run them in the order they were read and free the module.
+void FlushTopLevelExprs() {
+    if (PendingExprs.empty())
+        return;
+
+    FinalizeDebugInfo();
+
+    // In whole-program mode the expressions call into the library, compiled
+    // again only if a definition changed it.
+    if (KeepDefinitions()) {
+        CompileTimer Timer;
+        CompileWholeProgram();
+    }
 
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native function.
-            double (*FP)() = (double (*)()) (intptr_t) cantFail(ExprSymbol.getAddress());
-            fprintf(stderr, "%f\n", FP());
+    // JIT the module containing the anonymous expressions, keeping a handle so
+    // we can free it later.
+    std::vector<double (*)()> Entries;
+    orc::VModuleKey H;
+    {
+        CompileTimer Timer;
+        H = TheJIT->addModule(std::move(TheModule), getCodeGenOptLevel(ModuleTier));
+
+        // Get the entry points' addresses and cast them to the right type (takes
+        // no arguments, returns a double) so we can call them as native functions.
+        for (auto &Name : PendingExprs) {
+            auto Addr = TheJIT->getSymbolAddress(H, Name);
+            assert(Addr && "Function not found");
+            Entries.push_back((double (*)()) (intptr_t) Addr);
+        }
+    }
+    InitializeModuleAndPassManager();
+    PendingExprs.clear();
+    ReportRemarks();
+
+    // Other threads may compile while this one runs, the code only depends on
+    // the JIT, which is thread-safe. Each expression allocates from a region
+    // of its own, released in one step when it returns or is stopped. The
+    // lexer and parser are shared, so where this input stands is put back
+    // afterwards.
+    LexerState SavedLexer = SaveLexerState();
+    int SavedTok = CurTok;
+    CompilerLock.unlock();
+    for (auto *FP : Entries) {
+        char *Mark = regionmark();
+        double Result;
+        if (RunPreemptible(TimeLimit, [&] { Result = FP(); }))
+            PrintDouble(Result);
+        else
+            OutPrintf("Error: stopped after running for %u ms\n", (unsigned) TimeLimit);
+        regionrewind(Mark);
+    }
+    CompilerLock.lock();
+    RestoreLexerState(SavedLexer);
+    CurTok = SavedTok;
+
+    // Delete the anonymous expression module from the JIT.
+    TheJIT->removeModule(H);
+
+    // The expressions may have made some functions hot, or called them with
+    // the same constants often enough.
+    TierUpHotFunctions();
+    CompileSpecializations();
+}
+
+void HandleTopLevelExpression() {
+    // Entry points are named by their position in the batch, so the names are
+    // reused by the next batch.
+    std::string Name = "__anon_expr";
+    if (!PendingExprs.empty())
+        Name += "." + std::to_string(PendingExprs.size());
 
-            // Delete the anonymous expression module from the JIT.
-            TheJIT->removeModule(H);
+    // Evaluate a top-level expression into an anonymous function.
+    if (auto FnAST = ParseTopLevelExpr(Name)) {
+        // It runs once, so a later redefinition can't make a folded call stale.
+        FnAST->simplify(/*FoldCalls=*/true);
+        if (FnAST->codegen()) {
+            if (PendingExprs.empty())
+                BatchStart = std::chrono::steady_clock::now();
+            PendingExprs.push_back(Name);
+
+            auto Age = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - BatchStart);
+            if (PendingExprs.size() >= BatchSize || (BatchWindow && Age.count() >= BatchWindow))
+                FlushTopLevelExprs();
         }
     } else {
         // Skip token for error recovery.
@@ -403,43 +930,246 @@ void HandleTopLevelExpression() {
     }
 }
 
-/// top ::= definition | external | expression | ';'
-void MainLoop() {
+static void RunTopLevel(bool Prompt);
+
+/// ImportSettings - The options that change the code compiled from a file, and
+/// the builtin functions it is compiled against, for the keys of cached
+/// imports.
+static std::string ImportSettings() {
+    std::string Settings;
+    raw_string_ostream OS(Settings);
+    OS << "fast-math=" << FastMath << " g=" << (EmitDebugInfo || !RemarksPath.empty()) << " opt-tier=" << ForcedTier << " safepoints=" << Safepoints
+       << " vector-library=" << VecLib << " fold-fuel=" << FoldFuel;
+    for (const std::string &Entry : OperatorPrecedence)
+        OS << " op-prec=" << Entry;
+    // A builtin whose type changed, or a prelude function now shadowing a
+    // math builtin, changes the calls an import makes.
+    OS << "\nbuiltins:\n";
+    for (auto &Builtin : BuiltinProtos)
+        WriteProto(OS, *Builtin.second);
+    return OS.str();
+}
+
+/// CompileImport - Compile an imported file on its own: nothing of the
+/// importer is in its way, it only sees the builtin functions and the ones of
+/// its own imports, its definitions go to Object and nothing runs.
+static bool CompileImport(const std::string &Path, const std::string &Source, SmallVectorImpl<char> &Object,
+                          std::string &Protos) {
+    LexerState SavedLexer = SaveLexerState();
+    int SavedTok = CurTok;
+    std::unique_ptr<Module> SavedLibrary = std::move(TheLibrary);
+    auto SavedDefs = std::move(FunctionDefs);
+    FunctionDefs.clear();
+    auto SavedStructs = std::move(Structs);
+    Structs.clear();
+    auto SavedProtos = std::move(FunctionProtos);
+    FunctionProtos.clear();
+    for (auto &Builtin : BuiltinProtos)
+        FunctionProtos[Builtin.first] = llvm::make_unique<PrototypeAST>(*Builtin.second);
+
+    FILE *In = Source.empty() ? nullptr : fmemopen(const_cast<char *>(Source.data()), Source.size(), "r");
+    if (In) {
+        ++ImportDepth;
+        SetLexerInput(In, Path);
+        getNextToken();
+        RunTopLevel(/*Prompt=*/false);
+        --ImportDepth;
+        fclose(In);
+    }
+
+    // A file without definitions still gets an (empty) object, so it is cached.
+    if (!TheLibrary) {
+        TheLibrary = llvm::make_unique<Module>("import", TheContext);
+        TheLibrary->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+    }
+    TheLibrary->setTargetTriple(TheJIT->getTargetMachine().getTargetTriple().str());
+    raw_svector_ostream OS(Object);
+    bool Ok = EmitObjectFile(*TheLibrary, OS);
+    raw_string_ostream ProtosOS(Protos);
+    WriteProtos(*TheLibrary, ProtosOS);
+    ProtosOS.flush();
+
+    TheLibrary = std::move(SavedLibrary);
+    FunctionDefs = std::move(SavedDefs);
+    Structs = std::move(SavedStructs);
+    FunctionProtos = std::move(SavedProtos);
+    RestoreLexerState(SavedLexer);
+    CurTok = SavedTok;
+    return Ok;
+}
+
+/// import ::= 'import' string
+void HandleImport() {
+    getNextToken(); // eat import.
+    if (CurTok != tok_string) {
+        LogError("Expected a file name in quotes after import");
+        return;
+    }
+    ImportFile(StringVal, InputName, ImportSettings(), CompileImport);
+    getNextToken(); // eat the file name.
+}
+
+/// top ::= definition | external | import | struct | expression | ';'
+/// RunTopLevel - Handle top-level items until the input ends, CurTok holds the
+/// first token.
+static void RunTopLevel(bool Prompt) {
+    // Someone at a terminal sees the results before the next prompt, piped
+    // input only flushes when the buffer is full.
+    bool Interactive = Prompt && isatty(fileno(stdin));
+    if (!ImportDepth)
+        BeginLoad();
     while (true) {
-        fprintf(stderr, ">>> ");
+        // What the optimizer did to the item just compiled.
+        ReportRemarks();
+        if (Prompt) {
+            if (Interactive)
+                FlushOutput();
+            fprintf(stderr, ">>> ");
+        }
         switch (CurTok) {
             case tok_eof:
+                FlushTopLevelExprs();
+                ReportRemarks();
+                FlushOutput();
                 return;
             case ';': // ignore top-level semicolons.
                 getNextToken();
                 break;
             case tok_def:
+            case tok_memo:
+            case tok_fast:
+                // Run pending expressions first, so output keeps the order of
+                // the input and they see the definitions that came before them.
+                FlushTopLevelExprs();
                 HandleDefinition();
                 break;
             case tok_extern:
+                FlushTopLevelExprs();
                 HandleExtern();
                 break;
+            case tok_import:
+                FlushTopLevelExprs();
+                HandleImport();
+                break;
+            case tok_struct:
+                FlushTopLevelExprs();
+                HandleStruct();
+                break;
             default:
+                if (ImportDepth) {
+                    // Imported files are compiled ahead of time, nothing runs.
+                    LogError("an imported file can't have top-level expressions");
+                    if (!ParseExpression())
+                        getNextToken();
+                    break;
+                }
                 HandleTopLevelExpression();
                 break;
         }
     }
 }
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
+/// RunRequest - Run Source as if it had been typed into the REPL and return
+/// everything that was printed. Requests compile one at a time, their code
+/// runs in parallel.
+std::string RunRequest(const std::string &Source) {
+    if (Source.empty())
+        return "";
+
+    std::lock_guard<std::mutex> Lock(CompilerLock);
+    char *Text = nullptr;
+    size_t Size = 0;
+    FILE *In = fmemopen(const_cast<char *>(Source.data()), Source.size(), "r");
+    FILE *Out = open_memstream(&Text, &Size);
+    if (!In || !Out) {
+        if (In)
+            fclose(In);
+        if (Out)
+            fclose(Out);
+        free(Text);
+        return "Error: out of memory\n";
+    }
+
+    SetLexerInput(In, "<request>");
+    FILE *SavedOutput = Output;
+    Output = Out;
+    getNextToken();
+    RunTopLevel(/*Prompt=*/false);
+    Output = SavedOutput;
+    SetLexerInput(stdin, "<stdin>");
+
+    fclose(In);
+    fclose(Out);
+    std::string Result(Text, Size);
+    free(Text);
+    return Result;
+}
+
+//===----------------------------------------------------------------------===//
+// Embedding
+//===----------------------------------------------------------------------===//
+
+/// DeclareHostFunction - Make the host function at Address callable from L
+/// under the name and types of Prototype, written as after 'extern', e.g.
+/// "blur(img: double*, n: int): int". The host passes its own buffers and
+/// callbacks this way, nothing is copied or wrapped. Call it before any L
+/// source is read. Returns false if the prototype does not parse.
+bool DeclareHostFunction(const std::string &Prototype, void *Address) {
+    if (Prototype.empty())
+        return false;
+
+    std::lock_guard<std::mutex> Lock(CompilerLock);
+    FILE *In = fmemopen(const_cast<char *>(Prototype.data()), Prototype.size(), "r");
+    if (!In)
+        return false;
+    SetLexerInput(In, "<host>");
+    getNextToken();
+    auto Proto = ParsePrototype();
+    bool Ok = Proto && CurTok == tok_eof;
+    if (Ok) {
+        TheJIT->defineSymbol(Proto->getName(), (JITTargetAddress) (uintptr_t) Address);
+        AddBuiltinProto(std::move(Proto));
+    }
+    SetLexerInput(stdin, "<stdin>");
+    fclose(In);
+    return Ok;
+}
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char) X, stderr);
-    return 0;
+/// GetCompiledFunction - The newest compiled version of the L function Name
+/// as a C function pointer, or null. Sig is the C signature of its prototype:
+/// double, int64_t, double *, int64_t * or void * for a handle. Definitions
+/// kept for -whole-program or -build-prelude are not published.
+template <typename Sig>
+Sig *GetCompiledFunction(const std::string &Name) {
+    const orc::KaleidoscopeJIT::FunctionSlot *Slot = TheJIT->getFunctionSlot(Name);
+    if (!Slot)
+        return nullptr;
+    return (Sig *) (uintptr_t) Slot->load(std::memory_order_acquire);
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
-    return 0;
-}
\ No newline at end of file
+/// MainLoop - Read the command line options, then run the REPL and what the
+/// options ask for.
+void MainLoop(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "L language JIT compiler\n");
+    SelectOutput();
+    CheckMemoCapacity();
+    ApplyOperatorPrecedence();
+    RegisterJITEventListeners();
+    DeclareRegionFunctions();
+    DeclareSafepoints();
+    EnableRemarks(TheContext);
+    if (!PreludePath.empty())
+        LoadPrelude();
+
+    {
+        std::lock_guard<std::mutex> Lock(CompilerLock);
+        // The first module depends on the options, -g and -remarks.
+        InitializeModuleAndPassManager();
+        getNextToken();
+        RunTopLevel(/*Prompt=*/true);
+        if (!BuildPrelude.empty())
+            EmitPrelude();
+    }
+    if (!ServeSocket.empty())
+        Serve(ServeSocket, ServeThreads, RunRequest);
+}
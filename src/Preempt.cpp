@@ -0,0 +1,151 @@
+//
+// Preempt.cpp - time limits for running L code.
+//
+// With -safepoints, compiled code polls at loop back edges and function
+// entries: it loads safepointflag and branches on it, a branch that is not
+// taken while the flag is 0. A watchdog thread raises the flag once code that
+// runs under a time limit is past its deadline, and the late thread's next
+// poll calls safepoint(), which unwinds it with longjmp back to
+// RunPreemptible. The host gets an error instead of a thread that never comes
+// back. Other threads call safepoint() for nothing while the flag is up, only
+// until the late thread has stopped. -time-limit runs every top-level
+// expression this way.
+//
+
+#include "llvm/Support/CommandLine.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csetjmp>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+/// TimeLimit - How long a top-level expression may run.
+static cl::opt<unsigned> TimeLimit("time-limit",
+                                   cl::desc("Stop top-level expressions that run longer than this many "
+                                            "milliseconds (implies -safepoints)"),
+                                   cl::value_desc("ms"), cl::init(0));
+
+/// SafepointFlag - How many threads are past their deadline and have not
+/// stopped yet. Compiled code polls it as safepointflag.
+static std::atomic<int32_t> SafepointFlag(0);
+
+/// Deadline - Code running under a time limit on one thread.
+struct Deadline {
+    std::chrono::steady_clock::time_point When;
+    std::atomic<bool> Expired{false};
+    std::atomic<bool> Stopped{false};
+    Deadline *Outer; // The deadline this code runs inside of, on the same thread.
+    jmp_buf Unwind;
+};
+
+/// CurrentDeadline - The innermost deadline of this thread.
+static thread_local Deadline *CurrentDeadline = nullptr;
+
+/// Watchdog - The deadlines of all threads, watched by one thread. It is
+/// never freed, the thread runs until the process exits.
+struct Watchdog {
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::vector<Deadline *> Deadlines;
+
+    /// run - Expire deadlines as they pass.
+    void run() {
+        std::unique_lock<std::mutex> Guard(Lock);
+        while (true) {
+            auto Now = std::chrono::steady_clock::now();
+            auto Next = std::chrono::steady_clock::time_point::max();
+            for (Deadline *D : Deadlines) {
+                if (D->Expired)
+                    continue;
+                if (D->When <= Now) {
+                    D->Expired = true;
+                    SafepointFlag++;
+                } else {
+                    Next = std::min(Next, D->When);
+                }
+            }
+            if (Next == std::chrono::steady_clock::time_point::max())
+                Changed.wait(Guard);
+            else
+                Changed.wait_until(Guard, Next);
+        }
+    }
+
+    void arm(Deadline *D) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Deadlines.push_back(D);
+        Changed.notify_one();
+    }
+
+    /// disarm - Stop watching D, and lower the flag it raised.
+    void disarm(Deadline *D) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Deadlines.erase(std::find(Deadlines.begin(), Deadlines.end(), D));
+        if (D->Expired)
+            SafepointFlag--;
+    }
+};
+
+static Watchdog *getWatchdog() {
+    static Watchdog *W = [] {
+        auto *W = new Watchdog;
+        std::thread([W] { W->run(); }).detach();
+        return W;
+    }();
+    return W;
+}
+
+/// safepoint - Called by a poll that found the flag up. Unwinds this thread
+/// to the outermost of its deadlines that passed, or returns if none did.
+extern "C" DLLEXPORT void safepoint() {
+    Deadline *Late = nullptr;
+    for (Deadline *D = CurrentDeadline; D; D = D->Outer)
+        if (D->Expired)
+            Late = D;
+    if (!Late)
+        return;
+    // The deadlines inside the late one are left without returning.
+    for (Deadline *D = CurrentDeadline; D != Late; D = D->Outer)
+        getWatchdog()->disarm(D);
+    CurrentDeadline = Late;
+    Late->Stopped = true;
+    longjmp(Late->Unwind, 1);
+}
+
+/// RunPreemptible - Run Body, and stop it at its next safepoint once it has
+/// run Millis milliseconds, 0 for no limit. Returns false if it was stopped.
+/// Body should only call compiled L code: the frames unwound are not cleaned
+/// up, and a host function called from L that calls back into L is unwound
+/// as well.
+bool RunPreemptible(unsigned Millis, const std::function<void()> &Body) {
+    if (!Millis) {
+        Body();
+        return true;
+    }
+    Deadline D;
+    D.When = std::chrono::steady_clock::now() + std::chrono::milliseconds(Millis);
+    D.Outer = CurrentDeadline;
+    getWatchdog()->arm(&D);
+    CurrentDeadline = &D;
+    if (!setjmp(D.Unwind))
+        Body();
+    CurrentDeadline = D.Outer;
+    getWatchdog()->disarm(&D);
+    return !D.Stopped;
+}
+
+/// DeclareSafepoints - Give compiled code the flag and the function its polls
+/// use.
+void DeclareSafepoints() {
+    if (TimeLimit)
+        Safepoints = true;
+    TheJIT->defineSymbol("safepointflag", (JITTargetAddress) (uintptr_t) &SafepointFlag);
+    TheJIT->defineSymbol("safepoint", (JITTargetAddress) (uintptr_t) &safepoint);
+}
@@ -0,0 +1,144 @@
+//
+// Prelude.cpp - a library of L definitions compiled ahead of time.
+//
+// Build it once with
+//     LLVM-L-Language -build-prelude=prelude.o < ../lib/prelude.l
+// which writes the object file and a summary of its prototypes next to it
+// (prelude.o.protos). Starting with -prelude=prelude.o maps the object into
+// the JIT and registers the prototypes, nothing is lexed, parsed or compiled.
+//
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+/// PreludePath - Object file to load at startup.
+static cl::opt<std::string> PreludePath("prelude",
+                                        cl::desc("Load a precompiled prelude object at startup"),
+                                        cl::value_desc("file"), cl::init(""));
+
+/// BuildPrelude - Compile the definitions read from the input into this
+/// object file instead of running them.
+static cl::opt<std::string> BuildPrelude("build-prelude",
+                                         cl::desc("Compile the definitions in the input into a prelude object"),
+                                         cl::value_desc("file"), cl::init(""));
+
+/// KeepDefinitions - Definitions are collected into TheLibrary rather than
+/// handed to the JIT one by one.
+bool KeepDefinitions() {
+    return WholeProgram || !BuildPrelude.empty() || ImportDepth;
+}
+
+/// WriteTyped - Write Word, followed by ":type" unless T is a double.
+static void WriteTyped(raw_ostream &OS, const std::string &Word, ParamType T) {
+    OS << Word;
+    if (T != ParamType::Double)
+        OS << ':' << getParamTypeName(T);
+}
+
+/// ReadTyped - Split a word written by WriteTyped into the word and its type.
+static std::string ReadTyped(StringRef Word, ParamType &T) {
+    auto Parts = Word.split(':');
+    T = ParamType::Double;
+    if (!Parts.second.empty() && !getParamTypeByName(Parts.second.str(), T))
+        LogError(("unknown type in a prototype summary: " + Parts.second.str()).c_str());
+    return Parts.first.str();
+}
+
+/// EmitObjectFile - Compile M into an object file written to OS.
+bool EmitObjectFile(Module &M, raw_pwrite_stream &OS) {
+    // Ahead-of-time code gets the full backend, whatever the JIT compiled last.
+    TargetMachine &TM = TheJIT->getTargetMachine();
+    TM.setOptLevel(CodeGenOpt::Default);
+    legacy::PassManager PM;
+    if (TM.addPassesToEmitFile(PM, OS, nullptr, TargetMachine::CGFT_ObjectFile)) {
+        LogError("the target cannot emit an object file");
+        return false;
+    }
+    PM.run(M);
+    return true;
+}
+
+/// WriteProto - Write P as a "name arg..." line. Types other than double
+/// follow their name after a ':'.
+void WriteProto(raw_ostream &OS, const PrototypeAST &P) {
+    WriteTyped(OS, P.getName(), P.getRetType());
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; ++i) {
+        OS << ' ';
+        WriteTyped(OS, P.getArgs()[i], P.getArgType(i));
+    }
+    OS << '\n';
+}
+
+/// WriteProtos - Write the prototypes of the functions M exports, one line
+/// each.
+void WriteProtos(Module &M, raw_ostream &Protos) {
+    for (auto &F : M) {
+        if (F.isDeclaration() || F.hasLocalLinkage())
+            continue;
+        auto PI = FunctionProtos.find(F.getName().str());
+        if (PI != FunctionProtos.end())
+            WriteProto(Protos, *PI->second);
+    }
+}
+
+/// RegisterProtos - Make the functions of a summary written by WriteProtos
+/// callable, Builtin ones in imports as well.
+void RegisterProtos(StringRef Summary, bool Builtin = false) {
+    SmallVector<StringRef, 64> Lines;
+    Summary.split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+        SmallVector<StringRef, 8> Words;
+        Line.split(Words, ' ', -1, false);
+        ParamType RetType;
+        std::string Name = ReadTyped(Words[0], RetType);
+        std::vector<std::string> Args(Words.size() - 1);
+        std::vector<ParamType> ArgTypes(Words.size() - 1);
+        for (unsigned i = 1, e = Words.size(); i != e; ++i)
+            Args[i - 1] = ReadTyped(Words[i], ArgTypes[i - 1]);
+        auto Proto = llvm::make_unique<PrototypeAST>(Name, std::move(Args), CurLoc, std::move(ArgTypes), RetType);
+        if (Builtin)
+            AddBuiltinProto(std::move(Proto));
+        else
+            FunctionProtos[Name] = std::move(Proto);
+    }
+}
+
+/// EmitPrelude - Write TheLibrary as an object file, plus the prototypes of its
+/// functions.
+void EmitPrelude() {
+    if (!TheLibrary) {
+        LogError("no definitions to put in the prelude");
+        return;
+    }
+
+    std::error_code ObjEC, ProtosEC;
+    raw_fd_ostream Obj(BuildPrelude, ObjEC, sys::fs::OF_None);
+    raw_fd_ostream Protos(BuildPrelude + ".protos", ProtosEC, sys::fs::OF_None);
+    if (ObjEC || ProtosEC) {
+        LogError("cannot write the prelude");
+        return;
+    }
+
+    if (!EmitObjectFile(*TheLibrary, Obj))
+        return;
+    WriteProtos(*TheLibrary, Protos);
+    OutPrintf("Wrote prelude %s\n", BuildPrelude.c_str());
+}
+
+/// LoadPrelude - Map the prelude object into the JIT and make its functions
+/// callable by registering their prototypes.
+void LoadPrelude() {
+    auto Obj = MemoryBuffer::getFile(PreludePath, -1, /*RequiresNullTerminator=*/false);
+    auto Protos = MemoryBuffer::getFile(PreludePath + ".protos");
+    if (!Obj || !Protos) {
+        LogError("cannot read the prelude");
+        return;
+    }
+
+    TheJIT->addObjectFile(std::move(*Obj));
+    RegisterProtos((*Protos)->getBuffer(), /*Builtin=*/true);
+}
@@ -0,0 +1,185 @@
+//
+// Region.cpp - region allocator for memory L programs allocate.
+//
+// Memory comes from regions: large chunks handed out by bumping a pointer and
+// released all at once. Every thread has its own region, so alloc() never
+// takes a lock. Code marks it and rewinds to the mark to release everything
+// allocated since: the JIT around each top-level expression, a function that
+// allocated around its body, and a 'region { ... }' block around its own.
+// Data that has to outlive all of those goes into a named region, which lives
+// until freeregion() and may be shared by threads.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef DLLEXPORT
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+#endif
+
+/// Region - A stack of chunks that memory is bumped out of.
+class Region {
+    /// Chunk - The header of a chunk, its data follows.
+    struct Chunk {
+        Chunk *Prev;
+        char *End;
+    };
+
+    Chunk *Top = nullptr;
+    Chunk *Spare = nullptr; // The largest chunk released, kept for reuse.
+    char *Cur = nullptr, *End = nullptr;
+    size_t NextSize = MinChunk;
+
+    static const size_t MinChunk = 1 << 16, MaxChunk = 1 << 24;
+
+    static char *dataOf(Chunk *C) { return (char *) (C + 1); }
+
+    /// grow - Push a chunk with room for Bytes and allocate from it.
+    char *grow(size_t Bytes) {
+        Chunk *C = nullptr;
+        if (Spare && (size_t) (Spare->End - dataOf(Spare)) >= Bytes) {
+            C = Spare;
+            Spare = nullptr;
+        } else {
+            size_t Size = std::max(NextSize, Bytes);
+            C = (Chunk *) malloc(sizeof(Chunk) + Size);
+            if (!C)
+                return nullptr;
+            C->End = dataOf(C) + Size;
+            NextSize = std::min(NextSize * 2, (size_t) MaxChunk);
+        }
+        C->Prev = Top;
+        Top = C;
+        Cur = dataOf(C) + Bytes;
+        End = C->End;
+        return dataOf(C);
+    }
+
+    /// pop - Release the newest chunk, keeping the larger of it and the
+    /// spare.
+    void pop() {
+        Chunk *C = Top;
+        Top = C->Prev;
+        if (!Spare || Spare->End - dataOf(Spare) < C->End - dataOf(C))
+            std::swap(Spare, C);
+        free(C);
+    }
+
+public:
+    ~Region() {
+        rewind(nullptr);
+        free(Spare);
+    }
+
+    /// allocate - Bytes of memory, 16-byte aligned. Null if out of memory.
+    char *allocate(size_t Bytes) {
+        Bytes = (Bytes + 15) & ~(size_t) 15;
+        if ((size_t) (End - Cur) < Bytes)
+            return grow(Bytes);
+        char *P = Cur;
+        Cur += Bytes;
+        return P;
+    }
+
+    /// mark - Where the next allocation starts, to rewind to.
+    char *mark() const { return Cur; }
+
+    /// rewind - Release everything allocated since Mark was taken, or all of
+    /// the region for a null Mark.
+    void rewind(char *Mark) {
+        while (Top && !(Mark >= dataOf(Top) && Mark <= Top->End))
+            pop();
+        Cur = Top ? Mark : nullptr;
+        End = Top ? Top->End : nullptr;
+    }
+};
+
+/// ThreadRegion - The region alloc() uses on this thread.
+static thread_local Region ThreadRegion;
+
+/// NamedRegion - A region that lives until it is freed by name.
+struct NamedRegion {
+    std::mutex Lock;
+    Region Memory;
+};
+
+static std::mutex NamedRegionsLock;
+static std::map<std::string, std::unique_ptr<NamedRegion>> NamedRegions;
+
+/// allocate - N zeroed doubles from R.
+static double *allocate(Region &R, int64_t N) {
+    size_t Bytes = N > 0 ? (size_t) N * sizeof(double) : 0;
+    char *P = R.allocate(Bytes);
+    if (P)
+        memset(P, 0, Bytes);
+    return (double *) P;
+}
+
+/// alloc - N zeroed doubles, released with the innermost region block,
+/// function or top-level expression that allocated them.
+extern "C" DLLEXPORT double *alloc(int64_t N) {
+    return allocate(ThreadRegion, N);
+}
+
+/// regionmark, regionrewind - Release what this thread allocated in between.
+extern "C" DLLEXPORT char *regionmark() {
+    return ThreadRegion.mark();
+}
+
+extern "C" DLLEXPORT void regionrewind(char *Mark) {
+    ThreadRegion.rewind(Mark);
+}
+
+/// allocin - N zeroed doubles from the region called Name, which is created
+/// on first use.
+extern "C" DLLEXPORT double *allocin(const char *Name, int64_t N) {
+    NamedRegion *R;
+    {
+        std::lock_guard<std::mutex> Guard(NamedRegionsLock);
+        auto &Slot = NamedRegions[Name];
+        if (!Slot)
+            Slot.reset(new NamedRegion);
+        R = Slot.get();
+    }
+    std::lock_guard<std::mutex> Guard(R->Lock);
+    return allocate(R->Memory, N);
+}
+
+/// freeregion - Release the region called Name and everything in it.
+/// Returns 0.
+extern "C" DLLEXPORT double freeregion(const char *Name) {
+    std::lock_guard<std::mutex> Guard(NamedRegionsLock);
+    NamedRegions.erase(Name);
+    return 0;
+}
+
+/// DeclareRegionFunctions - Make alloc, allocin and freeregion callable from L
+/// without an extern.
+void DeclareRegionFunctions() {
+    struct {
+        const char *Name;
+        void *Address;
+        std::vector<std::string> Args;
+        std::vector<ParamType> ArgTypes;
+        ParamType RetType;
+    } Functions[] = {
+            {"alloc", (void *) &alloc, {"n"}, {ParamType::Int}, ParamType::DoublePtr},
+            {"allocin", (void *) &allocin, {"name", "n"}, {ParamType::Handle, ParamType::Int}, ParamType::DoublePtr},
+            {"freeregion", (void *) &freeregion, {"name"}, {ParamType::Handle}, ParamType::Double},
+    };
+    for (auto &F : Functions) {
+        TheJIT->defineSymbol(F.Name, (JITTargetAddress) (uintptr_t) F.Address);
+        AddBuiltinProto(llvm::make_unique<PrototypeAST>(F.Name, F.Args, CurLoc, F.ArgTypes, F.RetType));
+    }
+}
@@ -0,0 +1,203 @@
+//
+// Remarks.cpp - what the optimizer did and did not do to each function.
+//
+// With -remarks=FILE, the remarks of the passes that matter most for L code
+// (vectorizers, unrolling, inlining, LICM, GVN) are written to FILE as YAML
+// in the layout of LLVM's own remark files, so opt-viewer reads it, and a
+// summary per function is printed after each definition or batch of
+// expressions. Remarks carry the L function and source line, line info is
+// generated for that.
+//
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/raw_ostream.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/// RemarksPath - The YAML file remarks are written to.
+static cl::opt<std::string> RemarksPath("remarks",
+                                        cl::desc("Write optimization remarks to this YAML file and print "
+                                                 "a summary per function"),
+                                        cl::value_desc("file"), cl::init(""));
+
+/// RemarksPasses - The passes whose remarks are collected.
+static cl::opt<std::string> RemarksPasses("remarks-passes",
+                                          cl::desc("Regular expression of the passes to collect remarks of"),
+                                          cl::init("^(loop-vectorize|slp-vectorizer|loop-unroll|inline|licm|gvn)$"));
+
+/// MaxRemarksShown - Remarks listed per function in the summary, the file
+/// has all of them.
+static const unsigned MaxRemarksShown = 6;
+
+/// OptRemark - One remark, in L terms.
+struct OptRemark {
+    enum RemarkKind { Passed, Missed, Analysis } Kind;
+    std::string Pass, Name, Function, Message;
+    unsigned Line, Column;
+};
+
+/// getLFunctionName - The L name of a function the JIT generated.
+static std::string getLFunctionName(StringRef Name) {
+    if (Name.startswith("__anon_expr"))
+        return "top-level expression";
+    // A memo function's body, or a specialized copy.
+    Name.consume_back(".impl");
+    size_t Spec = Name.find(".spec");
+    if (Spec != StringRef::npos)
+        return (Name.substr(0, Spec) + " (specialized)").str();
+    return Name.str();
+}
+
+/// WriteYAMLString - Write S as a single-quoted YAML scalar.
+static void WriteYAMLString(raw_ostream &OS, StringRef S) {
+    OS << '\'';
+    for (char C : S) {
+        if (C == '\'')
+            OS << '\'';
+        OS << (C == '\n' ? ' ' : C);
+    }
+    OS << '\'';
+}
+
+/// RemarkCollector - Receives the remarks of the passes RemarksPasses
+/// matches, and lets every other diagnostic through.
+class RemarkCollector : public DiagnosticHandler {
+    Regex Passes;
+    std::unique_ptr<raw_fd_ostream> File;
+    std::vector<OptRemark> Pending;
+
+    /// enabled - The empty name asks whether any pass is enabled.
+    bool enabled(StringRef PassName) const { return PassName.empty() || Passes.match(PassName); }
+
+    void write(const OptRemark &R) {
+        static const char *const Tags[] = {"Passed", "Missed", "Analysis"};
+        raw_ostream &OS = *File;
+        OS << "--- !" << Tags[R.Kind] << "\nPass:            ";
+        WriteYAMLString(OS, R.Pass);
+        OS << "\nName:            ";
+        WriteYAMLString(OS, R.Name);
+        if (R.Line) {
+            OS << "\nDebugLoc:        { File: ";
+            WriteYAMLString(OS, InputName);
+            OS << ", Line: " << R.Line << ", Column: " << R.Column << " }";
+        }
+        OS << "\nFunction:        ";
+        WriteYAMLString(OS, R.Function);
+        OS << "\nArgs:\n  - String:          ";
+        WriteYAMLString(OS, R.Message);
+        OS << "\n...\n";
+    }
+
+public:
+    RemarkCollector(const std::string &Path, const std::string &PassRegex) : Passes(PassRegex) {
+        std::error_code EC;
+        File = llvm::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+        if (EC)
+            File.reset();
+    }
+
+    bool ok() const { return File != nullptr; }
+
+    bool isAnalysisRemarkEnabled(StringRef PassName) const override { return enabled(PassName); }
+
+    bool isMissedOptRemarkEnabled(StringRef PassName) const override { return enabled(PassName); }
+
+    bool isPassedOptRemarkEnabled(StringRef PassName) const override { return enabled(PassName); }
+
+    bool isAnyRemarkEnabled() const override { return true; }
+
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        auto *D = dyn_cast<DiagnosticInfoIROptimization>(&DI);
+        if (!D)
+            return false;
+        if (!enabled(D->getPassName()))
+            return true;
+
+        OptRemark R;
+        R.Kind = isa<OptimizationRemark>(D) ? OptRemark::Passed
+                 : isa<OptimizationRemarkMissed>(D) ? OptRemark::Missed : OptRemark::Analysis;
+        R.Pass = StringRef(D->getPassName()).str();
+        R.Name = D->getRemarkName().str();
+        R.Function = getLFunctionName(D->getFunction().getName());
+        R.Message = D->getMsg();
+        R.Line = D->isLocationAvailable() ? D->getLocation().getLine() : 0;
+        R.Column = D->isLocationAvailable() ? D->getLocation().getColumn() : 0;
+        write(R);
+        Pending.push_back(std::move(R));
+        return true;
+    }
+
+    /// report - Print the summary of the remarks since the last report.
+    void report() {
+        if (Pending.empty())
+            return;
+        File->flush();
+
+        // Group by function, in the order they were first seen.
+        std::vector<std::string> Order;
+        std::map<std::string, std::vector<const OptRemark *>> ByFunction;
+        for (const OptRemark &R : Pending) {
+            auto &List = ByFunction[R.Function];
+            if (List.empty())
+                Order.push_back(R.Function);
+            List.push_back(&R);
+        }
+
+        for (const std::string &Function : Order) {
+            unsigned Count[3] = {0, 0, 0};
+            for (const OptRemark *R : ByFunction[Function])
+                Count[R->Kind]++;
+            OutPrintf("Remarks for %s: %u passed, %u missed, %u analysis\n", Function.c_str(),
+                      Count[OptRemark::Passed], Count[OptRemark::Missed], Count[OptRemark::Analysis]);
+
+            // Missed optimizations first, they are the ones to act on.
+            unsigned Shown = 0, Listed = Count[OptRemark::Missed] + Count[OptRemark::Passed];
+            for (OptRemark::RemarkKind Kind : {OptRemark::Missed, OptRemark::Passed})
+                for (const OptRemark *R : ByFunction[Function]) {
+                    if (R->Kind != Kind || Shown == MaxRemarksShown)
+                        continue;
+                    Shown++;
+                    OutPrintf("  %s %s", Kind == OptRemark::Missed ? "missed" : "passed", R->Pass.c_str());
+                    if (R->Line)
+                        OutPrintf(" line %u", R->Line);
+                    OutPrintf(": %s\n", R->Message.c_str());
+                }
+            if (Listed > Shown)
+                OutPrintf("  ... %u more in %s\n", Listed - Shown, RemarksPath.c_str());
+        }
+        Pending.clear();
+    }
+};
+
+/// Remarks - The collector of -remarks, null without it.
+static RemarkCollector *Remarks = nullptr;
+
+/// EnableRemarks - Collect remarks of the code compiled in Context from now on.
+void EnableRemarks(LLVMContext &Context) {
+    if (RemarksPath.empty())
+        return;
+    auto Collector = llvm::make_unique<RemarkCollector>(RemarksPath, RemarksPasses);
+    if (!Collector->ok()) {
+        LogError(("cannot write " + RemarksPath).c_str());
+        return;
+    }
+    Remarks = Collector.get();
+    Context.setDiagnosticHandler(std::move(Collector));
+}
+
+/// ReportRemarks - Print the summary of the remarks of what was compiled since
+/// the last call.
+void ReportRemarks() {
+    if (Remarks)
+        Remarks->report();
+}
@@ -0,0 +1,174 @@
+//
+// Runtime.cpp - support library that JIT'd L code calls into.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef DLLEXPORT
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+#endif
+
+//----------------------------------------------------------------------
+// Memoization tables for `memo def`
+//----------------------------------------------------------------------
+
+/// MemoProbe - How many slots from the home slot a key may live in. This is
+/// also the set of slots the clock hand sweeps when one has to be evicted.
+static const unsigned MemoProbe = 8;
+
+/// MaxMemoCapacity - The most entries a memo table has, so the rounded up
+/// size can't overflow.
+static const unsigned MaxMemoCapacity = 1u << 24;
+
+/// MemoTable - Open-addressing cache from an argument tuple to the result of
+/// one memo function. The capacity is fixed, old entries are evicted with the
+/// clock (second chance) policy. Lock before use, a memo function may run on
+/// several threads at once.
+struct MemoTable {
+    enum SlotState : unsigned char { Empty, Full, Referenced };
+
+    std::mutex Lock;
+    std::string Name;
+    unsigned NumArgs;
+    unsigned Mask;
+    std::vector<double> Keys; // NumArgs doubles per slot.
+    std::vector<double> Values;
+    std::vector<unsigned char> State;
+    unsigned Hand = 0;
+
+    uint64_t Hits = 0, Misses = 0, Evictions = 0;
+
+    MemoTable(const std::string &Name, unsigned NumArgs, unsigned Capacity)
+            : Name(Name), NumArgs(NumArgs), Mask(Capacity - 1),
+              Keys((size_t) Capacity * NumArgs), Values(Capacity), State(Capacity, Empty) {}
+
+    void clear() {
+        std::fill(State.begin(), State.end(), Empty);
+        Hits = Misses = Evictions = 0;
+    }
+
+    /// hash - Mix the bit patterns of the arguments, so -0.0 and NaNs are keys
+    /// like any other value.
+    unsigned hash(const double *Args) const {
+        uint64_t H = 0xcbf29ce484222325ULL;
+        for (unsigned i = 0; i < NumArgs; i++) {
+            uint64_t Bits;
+            memcpy(&Bits, &Args[i], sizeof(Bits));
+            H = (H ^ Bits) * 0x100000001b3ULL;
+            H ^= H >> 29;
+        }
+        return (unsigned) H;
+    }
+
+    bool matches(unsigned Slot, const double *Args) const {
+        return !memcmp(&Keys[(size_t) Slot * NumArgs], Args, NumArgs * sizeof(double));
+    }
+
+    bool lookup(const double *Args, double *Out) {
+        unsigned Home = hash(Args);
+        for (unsigned i = 0; i < MemoProbe; i++) {
+            unsigned Slot = (Home + i) & Mask;
+            if (State[Slot] == Empty)
+                break; // Nothing is ever deleted, so the key can't be further on.
+            if (matches(Slot, Args)) {
+                State[Slot] = Referenced;
+                *Out = Values[Slot];
+                ++Hits;
+                return true;
+            }
+        }
+        ++Misses;
+        return false;
+    }
+
+    void insert(const double *Args, double Value) {
+        unsigned Home = hash(Args);
+        unsigned Slot = Mask + 1;
+        for (unsigned i = 0; i < MemoProbe; i++) {
+            unsigned S = (Home + i) & Mask;
+            if (State[S] == Empty || matches(S, Args)) {
+                Slot = S;
+                break;
+            }
+        }
+
+        // The probe window is full: give every referenced slot a second chance
+        // and take the first one that has not been used since the last sweep.
+        if (Slot > Mask) {
+            while (true) {
+                unsigned S = (Home + Hand) & Mask;
+                Hand = (Hand + 1) % MemoProbe;
+                if (State[S] == Referenced) {
+                    State[S] = Full;
+                    continue;
+                }
+                Slot = S;
+                ++Evictions;
+                break;
+            }
+        }
+
+        memcpy(&Keys[(size_t) Slot * NumArgs], Args, NumArgs * sizeof(double));
+        Values[Slot] = Value;
+        State[Slot] = Full;
+    }
+};
+
+/// MemoTables - One table per memo function name. Tables are never freed,
+/// code compiled against an old definition may still point at them.
+std::map<std::string, MemoTable *> MemoTables;
+std::mutex MemoTablesLock;
+
+/// GetMemoTable - Get the table for a memo function, a redefinition starts
+/// over with an empty one.
+MemoTable *GetMemoTable(const std::string &Name, unsigned NumArgs, unsigned Capacity) {
+    Capacity = std::min(Capacity, MaxMemoCapacity);
+    unsigned Size = MemoProbe;
+    while (Size < Capacity)
+        Size <<= 1;
+
+    std::lock_guard<std::mutex> Guard(MemoTablesLock);
+    MemoTable *&Table = MemoTables[Name];
+    if (Table && Table->NumArgs == NumArgs && Table->Mask == Size - 1) {
+        std::lock_guard<std::mutex> TableGuard(Table->Lock);
+        Table->clear();
+    } else
+        Table = new MemoTable(Name, NumArgs, Size);
+    return Table;
+}
+
+/// memo_lookup - Called on entry to a memo function. Returns 1 and stores the
+/// cached result in Out on a hit.
+extern "C" DLLEXPORT int memo_lookup(MemoTable *Table, const double *Args, double *Out) {
+    std::lock_guard<std::mutex> Guard(Table->Lock);
+    return Table->lookup(Args, Out);
+}
+
+/// memo_insert - Called with the result after a miss.
+extern "C" DLLEXPORT void memo_insert(MemoTable *Table, const double *Args, double Value) {
+    std::lock_guard<std::mutex> Guard(Table->Lock);
+    Table->insert(Args, Value);
+}
+
+/// memostats - Print the hit/miss counts of every memo function, returns 0.
+extern "C" DLLEXPORT double memostats() {
+    std::lock_guard<std::mutex> Guard(MemoTablesLock);
+    for (auto &T : MemoTables) {
+        std::lock_guard<std::mutex> TableGuard(T.second->Lock);
+        OutPrintf("memo %s: %llu hits, %llu misses, %llu evictions\n", T.first.c_str(),
+                  (unsigned long long) T.second->Hits, (unsigned long long) T.second->Misses,
+                  (unsigned long long) T.second->Evictions);
+    }
+    return 0;
+}
@@ -0,0 +1,328 @@
+//
+// RuntimeIO.cpp - buffered output and streaming input for L programs.
+//
+// Everything printed goes through a buffer per thread and reaches Output in
+// large writes: when the buffer fills, before an error or an interactive
+// prompt is shown, at the end of the input or of a server request, and when
+// L calls flushd(). A full buffer is written up to its last newline, so lines
+// printed by threads sharing a stream are never cut in half. Numbers read by
+// readd() and readarr() stream from the -data file in large chunks.
+//
+
+#include <cctype>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <string>
+
+#ifndef DLLEXPORT
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+#endif
+
+using namespace llvm;
+
+enum OutputStream { ToStderr, ToStdout };
+
+/// OutputTo - The stream results, listings and errors are printed to.
+static cl::opt<OutputStream> OutputTo("output", cl::desc("Where results and printed values go"),
+                                      cl::values(clEnumValN(ToStderr, "stderr", "standard error (default)"),
+                                                 clEnumValN(ToStdout, "stdout", "standard output")),
+                                      cl::init(ToStderr));
+
+/// DataPath - The file readd() and readarr() read numbers from.
+static cl::opt<std::string> DataPath("data",
+                                     cl::desc("Read the numbers for readd() and readarr() from this file"),
+                                     cl::value_desc("file"), cl::init(""));
+
+/// Output - Where results, listings and errors are printed. A server session
+/// points it at the reply to its client; per thread, since compiled code may
+/// print while another session compiles.
+thread_local FILE *Output = stderr;
+
+/// SelectOutput - Point Output at the stream chosen with -output.
+void SelectOutput() {
+    Output = OutputTo == ToStdout ? stdout : stderr;
+}
+
+//----------------------------------------------------------------------
+// Buffered output
+//----------------------------------------------------------------------
+
+/// OutputBuffer - What this thread printed that has not been written to Sink,
+/// the Output it was printed for, yet.
+class OutputBuffer {
+    char Data[1 << 16];
+    size_t Size = 0;
+    FILE *Sink = nullptr;
+
+    void writeOut(const char *S, size_t N) {
+        fwrite(S, 1, N, Sink);
+        fflush(Sink);
+    }
+
+public:
+    ~OutputBuffer() { flush(); }
+
+    /// reserve - Room for N more bytes printed to Output. Returns null if N
+    /// doesn't fit even into an empty buffer.
+    char *reserve(size_t N) {
+        if (Sink != Output) {
+            flush();
+            Sink = Output;
+        }
+        if (Size + N > sizeof(Data)) {
+            // Keep an unfinished line, unless it fills the whole buffer.
+            size_t Done = Size;
+            while (Done && Data[Done - 1] != '\n')
+                Done--;
+            if (!Done)
+                Done = Size;
+            writeOut(Data, Done);
+            memmove(Data, Data + Done, Size - Done);
+            Size -= Done;
+            if (Size + N > sizeof(Data))
+                flush();
+        }
+        return N <= sizeof(Data) ? Data + Size : nullptr;
+    }
+
+    /// commit - Add the N bytes written after reserve.
+    void commit(size_t N) { Size += N; }
+
+    void write(const char *S, size_t N) {
+        if (char *P = reserve(N)) {
+            memcpy(P, S, N);
+            commit(N);
+            return;
+        }
+        writeOut(S, N);
+    }
+
+    void flush() {
+        if (Size)
+            writeOut(Data, Size);
+        Size = 0;
+    }
+};
+
+static thread_local OutputBuffer OutBuffer;
+
+/// FlushOutput - Write out what this thread printed so far.
+void FlushOutput() {
+    OutBuffer.flush();
+}
+
+/// OutPrintf - printf to Output, through the buffer.
+void OutPrintf(const char *Format, ...) {
+    va_list Args, Copy;
+    va_start(Args, Format);
+    va_copy(Copy, Args);
+    const size_t Guess = 256;
+    char *P = OutBuffer.reserve(Guess);
+    int N = vsnprintf(P, Guess, Format, Args);
+    if (N >= 0 && (size_t) N < Guess)
+        OutBuffer.commit(N);
+    else if (N >= 0) {
+        std::string Long(N + 1, '\0');
+        vsnprintf(&Long[0], N + 1, Format, Copy);
+        OutBuffer.write(Long.data(), N);
+    }
+    va_end(Copy);
+    va_end(Args);
+}
+
+/// FormatDouble - Write X like printf("%f") to Buf, followed by Terminator.
+/// Buf must hold 330 bytes, enough for any double. Returns the length.
+static size_t FormatDouble(double X, char Terminator, char *Buf) {
+    // The integer part of A and the scaled fraction are exact, only halfway
+    // cases are left for printf to round.
+    double A = std::fabs(X);
+    double Int = std::floor(A);
+    double Frac = (A - Int) * 1e6;
+    double Below = std::floor(Frac);
+    if (!(A < 9e18) || std::fabs(Frac - Below - 0.5) < 1e-6) {
+        int N = snprintf(Buf, 329, "%f", X);
+        Buf[N] = Terminator;
+        return N + 1;
+    }
+
+    uint64_t I = (uint64_t) Int, F = (uint64_t) Below + (Frac - Below > 0.5);
+    if (F == 1000000) {
+        F = 0;
+        I++;
+    }
+
+    char Digits[20];
+    int NumDigits = 0;
+    do {
+        Digits[NumDigits++] = '0' + I % 10;
+        I /= 10;
+    } while (I);
+
+    char *P = Buf;
+    if (std::signbit(X))
+        *P++ = '-';
+    while (NumDigits)
+        *P++ = Digits[--NumDigits];
+    *P++ = '.';
+    for (int i = 5; i >= 0; i--, F /= 10)
+        P[i] = '0' + F % 10;
+    P += 6;
+    *P++ = Terminator;
+    return P - Buf;
+}
+
+/// PrintDouble - Print X like printf("%f") followed by Terminator.
+void PrintDouble(double X, char Terminator = '\n') {
+    OutBuffer.commit(FormatDouble(X, Terminator, OutBuffer.reserve(330)));
+}
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X) {
+    char C = (char) X;
+    OutBuffer.write(&C, 1);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" DLLEXPORT double printd(double X) {
+    PrintDouble(X);
+    return 0;
+}
+
+/// printarr - Print the N elements of P, one per line like printd. Returns 0.
+extern "C" DLLEXPORT double printarr(const double *P, int64_t N) {
+    for (int64_t i = 0; i < N; i++)
+        PrintDouble(P[i]);
+    return 0;
+}
+
+/// printrange - Print P[From] up to, not including, P[To] on one line,
+/// separated by spaces. Returns 0.
+extern "C" DLLEXPORT double printrange(const double *P, int64_t From, int64_t To) {
+    for (int64_t i = From; i < To; i++)
+        PrintDouble(P[i], i + 1 < To ? ' ' : '\n');
+    return 0;
+}
+
+/// flushd - Write out what this thread printed so far, returns 0.
+extern "C" DLLEXPORT double flushd() {
+    FlushOutput();
+    return 0;
+}
+
+//----------------------------------------------------------------------
+// Streaming input
+//----------------------------------------------------------------------
+
+/// DataInput - The -data file, opened on first use. Numbers are separated by
+/// whitespace or commas. Threads share it, each number is read once.
+class DataInput {
+    std::mutex Lock;
+    FILE *File = nullptr;
+    bool Opened = false, AtEnd = false;
+    bool Skipping = false; // Dropping the rest of a token too long for Buf.
+    char Buf[1 << 16];
+    size_t Pos = 0, End = 0;
+
+    static bool isSeparator(char C) { return isspace((unsigned char) C) || C == ','; }
+
+    /// fill - Keep the unread bytes and read more after them.
+    void fill() {
+        memmove(Buf, Buf + Pos, End - Pos);
+        End -= Pos;
+        Pos = 0;
+        size_t N = fread(Buf + End, 1, sizeof(Buf) - 1 - End, File);
+        End += N;
+        Buf[End] = '\0';
+        AtEnd = feof(File) || ferror(File);
+    }
+
+    bool open() {
+        if (!Opened) {
+            Opened = true;
+            File = DataPath.empty() ? nullptr : fopen(DataPath.c_str(), "r");
+            if (!File) {
+                FlushOutput();
+                fprintf(Output, "Error: cannot read the -data file '%s'\n", DataPath.c_str());
+            }
+        }
+        return File;
+    }
+
+    /// nextLocked - Read the next number, false at the end. Something that is
+    /// not a number reads as NaN, and so does a token longer than the buffer.
+    bool nextLocked(double &V) {
+        while (true) {
+            if (Skipping) {
+                while (Pos < End && !isSeparator(Buf[Pos]))
+                    Pos++;
+                if (Pos == End && !AtEnd) {
+                    fill();
+                    continue;
+                }
+                Skipping = false;
+            }
+            while (Pos < End && isSeparator(Buf[Pos]))
+                Pos++;
+            size_t TokEnd = Pos;
+            while (TokEnd < End && !isSeparator(Buf[TokEnd]))
+                TokEnd++;
+            // The number may go on in the next chunk, unless it fills the
+            // whole buffer already.
+            if (TokEnd == End && !AtEnd) {
+                if (Pos == 0 && End == sizeof(Buf) - 1) {
+                    V = std::numeric_limits<double>::quiet_NaN();
+                    Pos = End;
+                    Skipping = true;
+                    return true;
+                }
+                fill();
+                continue;
+            }
+            if (Pos == End)
+                return false;
+
+            char *NumEnd;
+            V = strtod(Buf + Pos, &NumEnd);
+            if (NumEnd != Buf + TokEnd)
+                V = std::numeric_limits<double>::quiet_NaN();
+            Pos = TokEnd;
+            return true;
+        }
+    }
+
+public:
+    /// read - Read up to N numbers into P, returns how many were read.
+    int64_t read(double *P, int64_t N) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (!open())
+            return 0;
+        int64_t Done = 0;
+        while (Done < N && nextLocked(P[Done]))
+            Done++;
+        return Done;
+    }
+};
+
+static DataInput DataFile;
+
+/// readd - The next number of the -data file, NaN at its end.
+extern "C" DLLEXPORT double readd() {
+    double V;
+    return DataFile.read(&V, 1) ? V : std::numeric_limits<double>::quiet_NaN();
+}
+
+/// readarr - Read up to N numbers of the -data file into P, returns how many
+/// were read.
+extern "C" DLLEXPORT int64_t readarr(double *P, int64_t N) {
+    return DataFile.read(P, N);
+}
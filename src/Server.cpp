@@ -0,0 +1,152 @@
+//
+// Server.cpp - keep one warm JIT and serve L over a Unix domain socket.
+//
+// Start the daemon with
+//     LLVM-L-Language -serve=/tmp/l.sock [-serve-threads=N] < definitions.l
+// It first runs its standard input as usual, then listens. A client sends
+// source and gets back everything the REPL would have printed for it. A
+// request ends at a line holding a single '.' or at the end of the stream,
+// and every reply is followed by a '.' line. Definitions go into the one JIT
+// every client shares, so they can be called by later requests from anyone.
+//
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+/// ServeSocket - Path of the socket to listen on once the input is done.
+static cl::opt<std::string> ServeSocket("serve",
+                                        cl::desc("Serve requests on this Unix domain socket after reading the input"),
+                                        cl::value_desc("path"), cl::init(""));
+
+/// ServeThreads - How many client sessions are served at the same time.
+static cl::opt<unsigned> ServeThreads("serve-threads",
+                                      cl::desc("Number of client sessions the server runs at once"),
+                                      cl::init(4));
+
+/// RequestHandler - Runs the source of one request and returns its output.
+typedef std::function<std::string(const std::string &)> RequestHandler;
+
+/// WriteAll - Write all of Data to FD, false if the client went away.
+static bool WriteAll(int FD, const std::string &Data) {
+    size_t Done = 0;
+    while (Done < Data.size()) {
+        ssize_t N = write(FD, Data.data() + Done, Data.size() - Done);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Done += N;
+    }
+    return true;
+}
+
+/// Reply - Send the output of a request, terminated by a '.' line.
+static bool Reply(int FD, std::string Out) {
+    if (!Out.empty() && Out.back() != '\n')
+        Out += '\n';
+    return WriteAll(FD, Out + ".\n");
+}
+
+/// ServeClient - One session: run the client's requests in the order they
+/// arrive until it hangs up.
+static void ServeClient(int FD, const RequestHandler &Handle) {
+    std::string Buffer, Request;
+    char Chunk[4096];
+    while (true) {
+        ssize_t N = read(FD, Chunk, sizeof(Chunk));
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            break;
+        Buffer.append(Chunk, N);
+
+        size_t Start = 0, End;
+        while ((End = Buffer.find('\n', Start)) != std::string::npos) {
+            StringRef Line(Buffer.data() + Start, End - Start);
+            Start = End + 1;
+            if (Line.rtrim('\r') != ".") {
+                Request.append(Line.data(), Line.size());
+                Request += '\n';
+                continue;
+            }
+            if (!Reply(FD, Handle(Request)))
+                return;
+            Request.clear();
+        }
+        Buffer.erase(0, Start);
+    }
+
+    Request += Buffer;
+    if (!Request.empty())
+        Reply(FD, Handle(Request));
+}
+
+/// Serve - Listen on Path and serve clients on a pool of Threads workers,
+/// each running one session at a time. Only returns if it can't listen.
+void Serve(const std::string &Path, unsigned Threads, const RequestHandler &Handle) {
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Addr.sun_path)) {
+        LogError("the server socket path is too long");
+        return;
+    }
+    memcpy(Addr.sun_path, Path.c_str(), Path.size());
+
+    // A socket left over from an earlier run is replaced, anything else at
+    // the path is not ours to delete.
+    struct stat Old;
+    if (lstat(Path.c_str(), &Old) == 0) {
+        if (!S_ISSOCK(Old.st_mode)) {
+            LogError(("cannot listen on " + Path + ": it exists and is not a socket").c_str());
+            return;
+        }
+        unlink(Path.c_str());
+    }
+
+    // Clients run code with the rights of the server, only its owner may
+    // connect.
+    int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t Mask = umask(0077);
+    bool Bound = Listener >= 0 && bind(Listener, (sockaddr *) &Addr, sizeof(Addr)) == 0;
+    umask(Mask);
+    if (!Bound || listen(Listener, SOMAXCONN) < 0) {
+        LogError(("cannot listen on " + Path + ": " + strerror(errno)).c_str());
+        if (Listener >= 0)
+            close(Listener);
+        return;
+    }
+
+    // A client hanging up mid-reply must not take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Serving on %s\n", Path.c_str());
+
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i < std::max(Threads, 1u); i++)
+        Workers.emplace_back([Listener, &Handle] {
+            while (true) {
+                int Client = accept(Listener, nullptr, nullptr);
+                if (Client < 0) {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    return;
+                }
+                ServeClient(Client, Handle);
+                close(Client);
+            }
+        });
+    for (auto &W : Workers)
+        W.join();
+    close(Listener);
+}
@@ -0,0 +1,399 @@
+//
+// Simplify.cpp - AST simplification that runs between parsing and codegen.
+//
+
+#include "llvm/Support/CommandLine.h"
+#include <cmath>
+
+using namespace llvm;
+
+/// FoldFuel - How many expressions may be evaluated to fold one call.
+static cl::opt<unsigned> FoldFuel("fold-fuel",
+                                  cl::desc("Evaluation steps allowed when folding a call at compile time"),
+                                  cl::init(10000));
+
+/// MaxFoldDepth - Nesting of calls allowed when folding one call.
+static const unsigned MaxFoldDepth = 128;
+
+/// FunctionDefs - The bodies of all definitions, for compile-time evaluation.
+std::map<std::string, std::unique_ptr<FunctionAST>> FunctionDefs;
+
+/// FoldingCalls - Calls to definitions may be evaluated in the function being
+/// simplified.
+static bool FoldingCalls = false;
+
+/// SimplifyExpr - Simplify E, replacing it if it folds into something else.
+void SimplifyExpr(std::unique_ptr<ExprAST> &E) {
+    if (!E)
+        return;
+    if (auto R = E->simplify())
+        E = std::move(R);
+}
+
+void SimplifyBody(std::vector<std::unique_ptr<ExprAST>> &Body) {
+    for (auto &E : Body)
+        SimplifyExpr(E);
+}
+
+/// EvaluateBody - Evaluate a list of expressions, the result is the last one.
+bool EvaluateBody(std::vector<std::unique_ptr<ExprAST>> &Body, EvalScope &Scope,
+                  EvalBudget &Budget, double &Result) {
+    if (Body.empty())
+        return false;
+    for (auto &E : Body)
+        if (!E || !E->evaluate(Scope, Budget, Result))
+            return false;
+    return true;
+}
+
+/// UseFuel - Every evaluated expression costs one unit of fuel.
+bool UseFuel(EvalBudget &Budget) {
+    if (!Budget.Fuel)
+        return false;
+    --Budget.Fuel;
+    return true;
+}
+
+/// IsTrue - The same test IfElseAST::codegen does: ordered and not 0.0.
+bool IsTrue(double V) { return !std::isnan(V) && V != 0.0; }
+
+/// FoldBinary - Compute a binary operator exactly like BinaryExprAST::codegen.
+bool FoldBinary(int Op, double L, double R, double &Result) {
+    switch (Op) {
+        case '+':
+            Result = L + R;
+            return true;
+        case '-':
+            Result = L - R;
+            return true;
+        case '*':
+            Result = L * R;
+            return true;
+        case '/':
+            Result = L / R;
+            return true;
+        case '<': // unordered or less than
+            Result = !(L >= R) ? 1.0 : 0.0;
+            return true;
+        case '>': // unordered or greater than
+            Result = !(L <= R) ? 1.0 : 0.0;
+            return true;
+        case tok_le: // unordered or less than or equal
+            Result = !(L > R) ? 1.0 : 0.0;
+            return true;
+        case tok_ge: // unordered or greater than or equal
+            Result = !(L < R) ? 1.0 : 0.0;
+            return true;
+        case tok_eq: // ordered and equal
+            Result = L == R ? 1.0 : 0.0;
+            return true;
+        case tok_ne: // unordered or not equal
+            Result = L != R ? 1.0 : 0.0;
+            return true;
+        case tok_and:
+            Result = IsTrue(L) && IsTrue(R) ? 1.0 : 0.0;
+            return true;
+        case tok_or:
+            Result = IsTrue(L) || IsTrue(R) ? 1.0 : 0.0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// EvaluateCall - Run the definition of Callee on constant arguments, or the
+/// host version of a math builtin.
+bool EvaluateCall(const std::string &Callee, const std::vector<double> &ArgVals,
+                  EvalBudget &Budget, double &Result) {
+    if (const MathBuiltin *B = getMathBuiltin(Callee)) {
+        if (B->NumArgs != ArgVals.size())
+            return false;
+        Result = B->Eval(ArgVals.data());
+        return true;
+    }
+
+    if (!FoldingCalls)
+        return false;
+    auto FI = FunctionDefs.find(Callee);
+    auto PI = FunctionProtos.find(Callee);
+    if (FI == FunctionDefs.end() || PI == FunctionProtos.end())
+        return false;
+
+    // Ints round at the boundary and buffers only exist at run time.
+    const std::vector<std::string> &ArgNames = PI->second->getArgs();
+    if (ArgNames.size() != ArgVals.size() || !PI->second->isAllDouble() ||
+        Budget.Depth >= MaxFoldDepth)
+        return false;
+
+    EvalScope Scope;
+    for (unsigned i = 0, e = ArgNames.size(); i != e; ++i)
+        Scope[ArgNames[i]] = ArgVals[i];
+
+    ++Budget.Depth;
+    bool Ok = EvaluateBody(FI->second->getBody(), Scope, Budget, Result);
+    --Budget.Depth;
+    return Ok;
+}
+
+//----------------------------------------------------------------------
+// simplify
+//----------------------------------------------------------------------
+
+std::unique_ptr<ExprAST> BinaryExprAST::simplify() {
+    // The left side of '=' is a variable or an element, only the index of an
+    // element can fold.
+    SimplifyExpr(LHS);
+    SimplifyExpr(RHS);
+
+    double L, R, Result;
+    if (LHS && RHS && LHS->getConstant(L) && RHS->getConstant(R) &&
+        FoldBinary(Op, L, R, Result))
+        return llvm::make_unique<NumberExprAST>(Result);
+
+    // A constant left side of && or || that decides the result means the right
+    // side never runs.
+    if (LHS && isLogical() && LHS->getConstant(L) && IsTrue(L) == (Op == tok_or))
+        return llvm::make_unique<NumberExprAST>(Op == tok_or ? 1.0 : 0.0);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> UnaryExprAST::simplify() {
+    SimplifyExpr(Operand);
+    double V;
+    if (Operand && Operand->getConstant(V))
+        return llvm::make_unique<NumberExprAST>(IsTrue(V) ? 0.0 : 1.0);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> IndexExprAST::simplify() {
+    SimplifyExpr(Base);
+    SimplifyExpr(Index);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> RecordArrayExprAST::simplify() {
+    SimplifyExpr(Count);
+    SimplifyExpr(Storage);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> FieldExprAST::simplify() {
+    SimplifyExpr(Index);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> VarDefineExprAST::simplify() {
+    for (auto &V : Varnames)
+        SimplifyExpr(V.second);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> CallExprAST::simplify() {
+    std::vector<double> ArgVals;
+    for (auto &Arg : Args) {
+        SimplifyExpr(Arg);
+        double V;
+        if (Arg && Arg->getConstant(V))
+            ArgVals.push_back(V);
+    }
+    if (ArgVals.size() != Args.size())
+        return nullptr;
+
+    // Calls to externs fail evaluation, so only side-effect-free runs fold.
+    EvalBudget Budget = {FoldFuel, 0};
+    double Result;
+    if (EvaluateCall(Callee, ArgVals, Budget, Result))
+        return llvm::make_unique<NumberExprAST>(Result);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> IfElseAST::simplify() {
+    SimplifyExpr(Cond);
+    SimplifyBody(Then);
+    SimplifyBody(Else);
+
+    double C;
+    if (!Cond || !Cond->getConstant(C))
+        return nullptr;
+
+    // Only the taken branch is left. An if without else is always 0.0.
+    if (!Else.empty())
+        return llvm::make_unique<BodyExprAST>(IsTrue(C) ? std::move(Then) : std::move(Else));
+    if (!IsTrue(C))
+        return llvm::make_unique<NumberExprAST>(0.0);
+    Then.push_back(llvm::make_unique<NumberExprAST>(0.0));
+    return llvm::make_unique<BodyExprAST>(std::move(Then));
+}
+
+std::unique_ptr<ExprAST> ForExprAST::simplify() {
+    SimplifyExpr(Start);
+    SimplifyExpr(End);
+    SimplifyExpr(Step);
+    SimplifyBody(Body);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> WhileExprAST::simplify() {
+    SimplifyExpr(Cond);
+    SimplifyBody(Body);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> RegionExprAST::simplify() {
+    SimplifyBody(Body);
+    return nullptr;
+}
+
+std::unique_ptr<ExprAST> BodyExprAST::simplify() {
+    SimplifyBody(Body);
+    return nullptr;
+}
+
+void FunctionAST::simplify(bool FoldCalls) {
+    FoldingCalls = FoldCalls;
+    SimplifyBody(Body);
+    FoldingCalls = false;
+}
+
+//----------------------------------------------------------------------
+// evaluate
+//----------------------------------------------------------------------
+
+bool NumberExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    Result = DoubleVal;
+    return UseFuel(Budget);
+}
+
+bool VariableExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    auto VI = Scope.find(Name);
+    if (VI == Scope.end())
+        return false;
+    Result = VI->second;
+    return UseFuel(Budget);
+}
+
+bool BinaryExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    if (!UseFuel(Budget))
+        return false;
+
+    if (Op == '=') {
+        const std::string *Name = LHS->getVariableName();
+        if (!Name || !Scope.count(*Name))
+            return false;
+        if (!RHS->evaluate(Scope, Budget, Result))
+            return false;
+        Scope[*Name] = Result;
+        return true;
+    }
+
+    double L, R;
+    if (!LHS->evaluate(Scope, Budget, L))
+        return false;
+    if (isLogical() && IsTrue(L) == (Op == tok_or)) {
+        Result = Op == tok_or ? 1.0 : 0.0;
+        return true;
+    }
+    if (!RHS->evaluate(Scope, Budget, R))
+        return false;
+    return FoldBinary(Op, L, R, Result);
+}
+
+bool UnaryExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    double V;
+    if (!UseFuel(Budget) || !Operand->evaluate(Scope, Budget, V))
+        return false;
+    Result = IsTrue(V) ? 0.0 : 1.0;
+    return true;
+}
+
+bool VarDefineExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    if (!UseFuel(Budget))
+        return false;
+    for (auto &V : Varnames) {
+        Result = 0.0;
+        if (V.second && !V.second->evaluate(Scope, Budget, Result))
+            return false;
+        Scope[V.first] = Result;
+    }
+    return true;
+}
+
+bool CallExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    if (!UseFuel(Budget))
+        return false;
+    std::vector<double> ArgVals(Args.size());
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+        if (!Args[i]->evaluate(Scope, Budget, ArgVals[i]))
+            return false;
+    return EvaluateCall(Callee, ArgVals, Budget, Result);
+}
+
+bool IfElseAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    double C;
+    if (!UseFuel(Budget) || !Cond->evaluate(Scope, Budget, C))
+        return false;
+    if (Else.empty()) {
+        if (IsTrue(C) && !EvaluateBody(Then, Scope, Budget, Result))
+            return false;
+        Result = 0.0;
+        return true;
+    }
+    return EvaluateBody(IsTrue(C) ? Then : Else, Scope, Budget, Result);
+}
+
+bool ForExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    double Var, EndVal, StepVal = 1.0;
+    if (!UseFuel(Budget) || !Start->evaluate(Scope, Budget, Var))
+        return false;
+
+    // The loop variable shadows an outer one for the duration of the loop.
+    auto OldVI = Scope.find(VarName);
+    bool HadOld = OldVI != Scope.end();
+    double OldVal = HadOld ? OldVI->second : 0.0;
+
+    while (true) {
+        Scope[VarName] = Var;
+        if (!End->evaluate(Scope, Budget, EndVal))
+            return false;
+        // Same unordered-less-than test as the loop header.
+        if (Var >= EndVal)
+            break;
+        for (auto &E : Body)
+            if (!E || !E->evaluate(Scope, Budget, Result))
+                return false;
+        if (Step && !Step->evaluate(Scope, Budget, StepVal))
+            return false;
+        Var += StepVal;
+    }
+
+    if (HadOld)
+        Scope[VarName] = OldVal;
+    else
+        Scope.erase(VarName);
+
+    Result = 0.0;
+    return true;
+}
+
+bool WhileExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    double C;
+    while (true) {
+        if (!UseFuel(Budget) || !Cond->evaluate(Scope, Budget, C))
+            return false;
+        if (!IsTrue(C))
+            break;
+        for (auto &E : Body)
+            if (!E || !E->evaluate(Scope, Budget, Result))
+                return false;
+    }
+    Result = 0.0;
+    return true;
+}
+
+bool BodyExprAST::evaluate(EvalScope &Scope, EvalBudget &Budget, double &Result) {
+    if (Body.empty()) {
+        Result = 0.0;
+        return UseFuel(Budget);
+    }
+    return EvaluateBody(Body, Scope, Budget, Result);
+}
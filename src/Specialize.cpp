@@ -0,0 +1,105 @@
+//
+// Specialize.cpp - specialized copies of functions for constant arguments.
+//
+// Calls that pass literal constants are counted per function and pattern of
+// constants. Once -specialize-after calls used the same pattern, the function
+// is compiled again under a new name with those arguments bound, so the
+// constants propagate through its body, and later calls with the same
+// constants go to the copy. The generic version stays for every other call.
+//
+
+#include "llvm/Support/CommandLine.h"
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+/// SpecializeAfter - Calls with one pattern of constants before it gets its
+/// own copy of the function.
+static cl::opt<unsigned> SpecializeAfter("specialize-after",
+                                         cl::desc("Specialize a function for constant arguments after this "
+                                                  "many calls pass the same ones (0 to never)"),
+                                         cl::init(3));
+
+/// ConstArgs - The constant arguments of a call as (position, bit pattern)
+/// pairs, so -0.0 and NaNs are told apart like any other value.
+typedef std::vector<std::pair<unsigned, uint64_t>> ConstArgs;
+
+/// getBoundValue - The value bound to argument Idx, false if it is not bound.
+bool getBoundValue(const ConstArgs &Bound, unsigned Idx, double &V) {
+    for (auto &C : Bound)
+        if (C.first == Idx) {
+            memcpy(&V, &C.second, sizeof(V));
+            return true;
+        }
+    return false;
+}
+
+/// SpecState - Where a pattern of constants stands.
+struct SpecState {
+    unsigned Calls = 0;
+    enum { Counting, Queued, Ready, Failed } Stage = Counting;
+    std::string Name; // Of the specialized copy.
+};
+
+/// SpecRequest - A specialization to compile.
+struct SpecRequest {
+    std::string Callee;
+    ConstArgs Bound;
+    std::string Name;
+};
+
+static std::map<std::pair<std::string, ConstArgs>, SpecState> Specializations;
+static std::vector<SpecRequest> SpecQueue;
+static unsigned NumSpecializations = 0;
+
+/// NoteConstantCall - Count a call to Callee with constants Bound. Returns the
+/// name of the specialized copy to call instead, or null.
+const std::string *NoteConstantCall(const std::string &Callee, const ConstArgs &Bound) {
+    if (!SpecializeAfter || Bound.empty())
+        return nullptr;
+    SpecState &S = Specializations[{Callee, Bound}];
+    if (S.Stage == SpecState::Ready)
+        return &S.Name;
+    if (S.Stage == SpecState::Counting && ++S.Calls >= SpecializeAfter) {
+        S.Stage = SpecState::Queued;
+        S.Name = Callee + ".spec" + std::to_string(++NumSpecializations);
+        SpecQueue.push_back({Callee, Bound, S.Name});
+    }
+    return nullptr;
+}
+
+/// TakeSpecRequests - The specializations that reached the threshold since the
+/// last call.
+std::vector<SpecRequest> TakeSpecRequests() {
+    std::vector<SpecRequest> Requests;
+    Requests.swap(SpecQueue);
+    return Requests;
+}
+
+/// FinishSpecialization - Calls with R's constants go to the copy from now on,
+/// or keep going to the generic version if it could not be compiled.
+void FinishSpecialization(const SpecRequest &R, bool Compiled) {
+    auto I = Specializations.find({R.Callee, R.Bound});
+    if (I != Specializations.end() && I->second.Name == R.Name)
+        I->second.Stage = Compiled ? SpecState::Ready : SpecState::Failed;
+}
+
+/// ForgetSpecializations - Callee was redefined, its copies are out of date.
+/// Returns the names of the copies that were compiled, code compiled earlier
+/// still calls them.
+std::vector<std::string> ForgetSpecializations(const std::string &Callee) {
+    std::vector<std::string> Compiled;
+    for (auto I = Specializations.begin(); I != Specializations.end();)
+        if (I->first.first == Callee) {
+            if (I->second.Stage == SpecState::Ready)
+                Compiled.push_back(I->second.Name);
+            I = Specializations.erase(I);
+        } else
+            ++I;
+    return Compiled;
+}
@@ -0,0 +1,160 @@
+//
+// Tiering.cpp - choose how hard each function is optimized.
+//
+// Every function gets a tier from a cost model: small functions and loops are
+// optimized fully, large straight-line code gets fewer passes and a cheaper
+// backend. With -compile-budget, once a load (the input, or one server
+// request) has spent its compile time, new functions get the quick tier.
+// Functions below the full tier count their calls, and the ones that turn out
+// to be hot are compiled again at the full tier.
+//
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/CommandLine.h"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/// OptTier - How hard a function is optimized. Quick only promotes variables
+/// to registers and skips backend optimization, Basic adds the scalar clean-up
+/// passes, Full adds the loop passes and the vectorizers.
+enum OptTier { TierQuick, TierBasic, TierFull, NumOptTiers, TierAuto };
+
+/// ForcedTier - Compile everything at one tier instead of asking the model.
+static cl::opt<OptTier> ForcedTier("opt-tier", cl::desc("Optimization tier of every function"),
+                                   cl::values(clEnumValN(TierAuto, "auto", "Pick per function (default)"),
+                                              clEnumValN(TierQuick, "quick", "Registers only, no backend optimization"),
+                                              clEnumValN(TierBasic, "basic", "Scalar optimizations"),
+                                              clEnumValN(TierFull, "full", "Scalar, loop and vector optimizations")),
+                                   cl::init(TierAuto));
+
+/// CompileBudget - Compile time a load may spend before new functions are
+/// only compiled quickly.
+static cl::opt<unsigned> CompileBudget("compile-budget",
+                                       cl::desc("Milliseconds of optimization per load before new functions "
+                                                "get the quick tier (0 for no limit)"),
+                                       cl::init(0));
+
+/// HotCalls - Calls after which a function below the full tier is recompiled.
+static cl::opt<unsigned> HotCalls("hot-calls",
+                                  cl::desc("Recompile a function at the full tier after this many calls"),
+                                  cl::init(10000));
+
+/// SmallFunction, LargeFunction - Instruction counts of unoptimized IR below
+/// which optimizing is always worth it, and above which it only is for loops.
+static const unsigned SmallFunction = 200;
+static const unsigned LargeFunction = 2000;
+
+/// FunctionCost - What the cost model knows about a function.
+struct FunctionCost {
+    unsigned Instructions;
+    unsigned LoopDepth;
+};
+
+/// MeasureFunction - Size and loop depth of the unoptimized F.
+FunctionCost MeasureFunction(Function &F) {
+    FunctionCost C = {0, 0};
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    for (auto &BB : F) {
+        C.Instructions += BB.size();
+        C.LoopDepth = std::max(C.LoopDepth, LI.getLoopDepth(&BB));
+    }
+    return C;
+}
+
+/// FunctionProfile - The tier a definition was compiled at and, below the
+/// full tier, how often it has been called. Profiles live as long as the
+/// process, compiled code holds the address of Calls.
+struct FunctionProfile {
+    std::atomic<uint64_t> Calls{0};
+    OptTier Tier = TierFull;
+};
+
+static std::map<std::string, std::unique_ptr<FunctionProfile>> Profiles;
+
+FunctionProfile &GetProfile(const std::string &Name) {
+    auto &P = Profiles[Name];
+    if (!P)
+        P = llvm::make_unique<FunctionProfile>();
+    return *P;
+}
+
+/// CompileSpent - Time spent optimizing and generating code in this load.
+static std::chrono::steady_clock::duration CompileSpent;
+
+/// BeginLoad - Start the compile budget of a new load.
+void BeginLoad() {
+    CompileSpent = std::chrono::steady_clock::duration::zero();
+}
+
+/// CompileTimer - Charges its lifetime to the compile budget.
+class CompileTimer {
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+public:
+    ~CompileTimer() { CompileSpent += std::chrono::steady_clock::now() - Start; }
+};
+
+static bool OverBudget() {
+    return CompileBudget &&
+           CompileSpent >= std::chrono::milliseconds((unsigned) CompileBudget);
+}
+
+/// ChooseTier - The tier of a function of cost C that was called Calls times
+/// while a previous definition of it was running.
+OptTier ChooseTier(const FunctionCost &C, uint64_t Calls) {
+    if (ForcedTier != TierAuto)
+        return ForcedTier;
+    if (Calls >= HotCalls)
+        return TierFull;
+    if (OverBudget())
+        return TierQuick;
+    if (C.Instructions > LargeFunction)
+        return C.LoopDepth ? TierBasic : TierQuick;
+    if (C.Instructions > SmallFunction && !C.LoopDepth)
+        return TierBasic;
+    return TierFull;
+}
+
+/// getCodeGenOptLevel - The backend optimization level of a tier.
+CodeGenOpt::Level getCodeGenOptLevel(OptTier Tier) {
+    switch (Tier) {
+        case TierQuick:
+            return CodeGenOpt::None;
+        case TierBasic:
+            return CodeGenOpt::Less;
+        default:
+            return CodeGenOpt::Default;
+    }
+}
+
+/// EmitCallCounter - Count the calls of F in its profile.
+void EmitCallCounter(Function &F, FunctionProfile &Profile) {
+    IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+    Value *Counter = ConstantExpr::getIntToPtr(
+            B.getInt64((uint64_t) (uintptr_t) &Profile.Calls), B.getInt64Ty()->getPointerTo());
+    B.CreateAtomicRMW(AtomicRMWInst::Add, Counter, B.getInt64(1), AtomicOrdering::Monotonic);
+}
+
+/// TakeHotFunctions - The functions below the full tier that were called at
+/// least HotCalls times. They are marked full, so they are only returned once.
+std::vector<std::string> TakeHotFunctions() {
+    std::vector<std::string> Hot;
+    if (ForcedTier != TierAuto)
+        return Hot;
+    for (auto &P : Profiles)
+        if (P.second->Tier < TierFull && P.second->Calls.load(std::memory_order_relaxed) >= HotCalls) {
+            P.second->Tier = TierFull;
+            Hot.push_back(P.first);
+        }
+    return Hot;
+}
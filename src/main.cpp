@@ -0,0 +1,15 @@
+//
+// main.cpp - the L compiler: a REPL on stdin, see MainLoop for the options.
+//
+
+#include "Parser.cpp"
+
+int main(int argc, char **argv) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    TheJIT = llvm::make_unique<orc::KaleidoscopeJIT>();
+    MainLoop(argc, argv);
+    return 0;
+}
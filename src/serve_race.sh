@@ -0,0 +1,36 @@
+# Two clients of one server: one keeps redefining f, the other keeps calling
+# it, directly and through g. Every call must see one of the definitions.
+# Build ./main with run.sh first. NC is a netcat that speaks Unix sockets and
+# closes its side at the end of its input.
+NC=${NC:-"nc -N -U"}
+SOCK=/tmp/l-race.$$.sock
+ROUNDS=${ROUNDS:-200}
+
+printf 'def f(x) x + 1;\ndef g(x) f(x) * 10;\n' | ./main -serve=$SOCK -serve-threads=4 > /dev/null 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2> /dev/null; rm -f $SOCK' EXIT
+while [ ! -S $SOCK ]; do sleep 0.1; done
+
+i=0
+while [ $i -lt $ROUNDS ]; do
+    printf 'def f(x) x + %d;\n.\n' $((i % 2 + 1))
+    i=$((i + 1))
+done | $NC $SOCK > /tmp/l-race.$$.defs &
+WRITER=$!
+
+i=0
+while [ $i -lt $ROUNDS ]; do
+    printf 'f(1);\n.\ng(1);\n.\n'
+    i=$((i + 1))
+done | $NC $SOCK > /tmp/l-race.$$.calls
+wait $WRITER
+
+BAD=$(grep -v -x -e '2.000000' -e '3.000000' -e '20.000000' -e '30.000000' -e '.' /tmp/l-race.$$.calls)
+CALLS=$(grep -c -x -e '[23]0*\.000000' /tmp/l-race.$$.calls)
+rm -f /tmp/l-race.$$.defs /tmp/l-race.$$.calls
+if [ -n "$BAD" ] || [ "$CALLS" -ne $((ROUNDS * 2)) ]; then
+    echo "FAIL: $CALLS of $((ROUNDS * 2)) calls answered, unexpected output:"
+    echo "$BAD"
+    exit 1
+fi
+echo "OK: $CALLS calls during $ROUNDS redefinitions"